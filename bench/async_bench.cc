@@ -0,0 +1,258 @@
+// Part of measurement-kit <https://measurement-kit.github.io/>.
+// Measurement-kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+
+// Microbenchmark suite for the async bridge. Synthetic producer threads,
+// standing in for MK threads, suspend log, entry and progress events while
+// the main thread keeps draining, as libuv's loop would do. libuv APIs are
+// mocked, so only the cost of the bridge itself is measured. We compare the
+// previous implementation (a list of closures protected by a recursive mutex)
+// with the current lock-free queue, used both with closures and with typed
+// Event records. In all runs, producers wait for the drain side when
+// `max_in_flight` events are in flight, which is less than the capacity of
+// the smallest lane (the control lane, where closures go), so that we
+// measure the lock-free queue rather than the overflow list, and rows can be
+// compared with each other. For each run we report the throughput, the 50th
+// and 99th percentile of the time between suspending and delivering an
+// event, and the heap allocations per event.
+
+#include "private/node/async.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Count all the heap allocations made by the process. This is a bit coarse
+// but it does not require any external tool.
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size != 0 ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc{};
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+namespace legacy {
+
+// This is how the async bridge was implemented before the lock-free queue.
+class Context {
+  public:
+    uv_async_t async{};
+    std::recursive_mutex mutex;
+    std::list<std::function<void()>> suspended;
+};
+
+template <MK_MOCK(uv_async_send)>
+static void suspend(mk::SharedPtr<Context> ctx, std::function<void()> &&func) {
+    std::unique_lock<std::recursive_mutex> _{ctx->mutex};
+    ctx->suspended.push_back(std::move(func));
+    if (uv_async_send(&ctx->async) != 0) {
+        throw std::runtime_error("uv_async_send");
+    }
+}
+
+static void drain(Context &ctx) {
+    std::list<std::function<void()>> functions;
+    {
+        std::unique_lock<std::recursive_mutex> _{ctx.mutex};
+        std::swap(ctx.suspended, functions);
+    }
+    for (auto &fn : functions) {
+        fn();
+    }
+}
+
+} // namespace legacy
+
+// The mock loop. Since the main thread drains continuously, initializing
+// and waking up the loop are no-ops.
+static int fake_uv_async_init(uv_loop_t *, uv_async_t *, uv_async_cb) {
+    return 0;
+}
+
+static int fake_uv_async_send(uv_async_t *) { return 0; }
+
+// The total number of events suspended by each run, divided among producers.
+static const uint64_t events_per_run = 1 << 19;
+
+// The maximum number of events in flight, well below the 64 cells of the
+// control lane, which is the smallest one.
+static const uint64_t max_in_flight = 32;
+
+// The kinds of events we suspend, with payloads of realistic size.
+enum class Kind { log, entry, progress };
+
+static const char *kind_name(Kind kind) {
+    switch (kind) {
+    case Kind::log:
+        return "log";
+    case Kind::entry:
+        return "entry";
+    default:
+        return "progress";
+    }
+}
+
+static const std::string &payload_of(Kind kind) {
+    static const std::string log_line =
+            "[!] ndt: test_c2s: connected to remote host; starting upload";
+    static const std::string entry = "{\"test_keys\":{\"simple\":{\"upload\":"
+                                     "7389.2,\"download\":42712.7,\"ping\":"
+                                     "12.0},\"advanced\":{" +
+                                     std::string(900, ' ') + "}}}";
+    static const std::string progress = "measuring download speed";
+    switch (kind) {
+    case Kind::log:
+        return log_line;
+    case Kind::entry:
+        return entry;
+    default:
+        return progress;
+    }
+}
+
+// The Recorder is what the drain side uses to record the latency of each
+// delivered event. Only the draining thread writes into it, and the storage
+// is preallocated, so that recording does not allocate.
+class Recorder {
+  public:
+    std::vector<uint64_t> latencies;
+    std::atomic<uint64_t> consumed{0};
+
+    void record(uint64_t enqueued_at) {
+        uint64_t n = consumed.load(std::memory_order_relaxed);
+        latencies[n] = uv_hrtime() - enqueued_at;
+        consumed.store(n + 1, std::memory_order_relaxed);
+    }
+};
+
+// Runs `producers` threads that call `post` to suspend `kind` events while
+// the calling thread calls `drain`, and prints the results. Each delivered
+// event must call `recorder.record()` with the time at which it was posted.
+// If `burst` is not zero, producers wait when `burst` events are in flight.
+template <typename Context, typename Post, typename Drain>
+static void run(const char *name, Kind kind, int producers,
+        mk::SharedPtr<Context> ctx, Recorder &recorder, Post post,
+        Drain drain, uint64_t burst = 0) {
+    uint64_t per_producer = events_per_run / producers;
+    uint64_t total = per_producer * producers;
+    recorder.latencies.assign(total, 0);
+    recorder.consumed = 0;
+    const std::string &payload = payload_of(kind);
+    std::atomic<bool> go{false};
+    std::atomic<uint64_t> posted{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < producers; ++i) {
+        threads.emplace_back([&]() {
+            while (!go) {
+                std::this_thread::yield();
+            }
+            for (uint64_t j = 0; j < per_producer; ++j) {
+                uint64_t n = posted;
+                while (burst != 0 &&
+                        (n - recorder.consumed >= burst ||
+                                !posted.compare_exchange_weak(n, n + 1))) {
+                    std::this_thread::yield();
+                    n = posted;
+                }
+                post(ctx, payload, (double)j / (double)per_producer);
+            }
+        });
+    }
+    uint64_t allocations_before = allocations;
+    auto begin = std::chrono::steady_clock::now();
+    go = true;
+    while (recorder.consumed < total) {
+        uint64_t consumed = recorder.consumed;
+        drain(*ctx);
+        if (recorder.consumed == consumed) {
+            std::this_thread::yield(); // Let producers run, as epoll would
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    uint64_t allocated = allocations - allocations_before;
+    for (auto &t : threads) {
+        t.join();
+    }
+    std::sort(recorder.latencies.begin(), recorder.latencies.end());
+    double seconds =
+            std::chrono::duration_cast<std::chrono::duration<double>>(elapsed)
+                    .count();
+    printf("%-10s %-8s %9d %12.0f %10.1f %10.1f %8.2f\n", name,
+            kind_name(kind), producers, (double)total / seconds,
+            recorder.latencies[total / 2] / 1e03,
+            recorder.latencies[total * 99 / 100] / 1e03,
+            (double)allocated / (double)total);
+}
+
+int main() {
+    using namespace mk::node;
+    printf("%-10s %-8s %9s %12s %10s %10s %8s\n", "bridge", "kind",
+            "producers", "events/s", "p50 (us)", "p99 (us)", "allocs");
+    Recorder recorder;
+    for (Kind kind : {Kind::log, Kind::entry, Kind::progress}) {
+        for (int producers : {1, 4, 16, 64}) {
+            run<legacy::Context>("list+mutex", kind, producers,
+                    mk::SharedPtr<legacy::Context>{new legacy::Context},
+                    recorder,
+                    [&recorder](mk::SharedPtr<legacy::Context> ctx,
+                            const std::string &s, double percentage) {
+                        legacy::suspend<fake_uv_async_send>(ctx, [
+                            &recorder, s, percentage, now = uv_hrtime()
+                        ]() {
+                            (void)percentage;
+                            recorder.record(now);
+                        });
+                    },
+                    legacy::drain, max_in_flight);
+            mk::SharedPtr<async::Context> closures =
+                    async::make<fake_uv_async_init>();
+            run<async::Context>("closure", kind, producers, closures,
+                    recorder,
+                    [&recorder](const mk::SharedPtr<async::Context> &ctx,
+                            const std::string &s, double percentage) {
+                        async::suspend<fake_uv_async_send>(ctx, [
+                            &recorder, s, percentage, now = uv_hrtime()
+                        ]() {
+                            (void)percentage;
+                            recorder.record(now);
+                        });
+                    },
+                    async::drain, max_in_flight);
+            async::unregister(closures);
+            mk::SharedPtr<async::Context> events =
+                    async::make<fake_uv_async_init>();
+            events->dispatch = [&recorder](async::Event &ev) {
+                recorder.record(ev.enqueued_at);
+            };
+            async::EventType type = (kind == Kind::log)
+                                            ? async::EventType::log
+                                            : (kind == Kind::entry)
+                                                      ? async::EventType::entry
+                                                      : async::EventType::progress;
+            run<async::Context>("event", kind, producers, events, recorder,
+                    [type](const mk::SharedPtr<async::Context> &ctx,
+                            const std::string &s, double percentage) {
+                        async::emit<fake_uv_async_send>(
+                                ctx, type, [&](async::Event &ev) {
+                                    ev.level = 0;
+                                    ev.values[0] = percentage;
+                                    ev.payload.assign(s);
+                                });
+                    },
+                    async::drain, max_in_flight);
+            async::unregister(events);
+        }
+    }
+}
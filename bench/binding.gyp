@@ -0,0 +1,26 @@
+{
+  "targets": [
+    {
+      "target_name": "async_bench",
+      "type": "executable",
+      "sources": [
+        "async_bench.cc"
+      ],
+      "include_dirs": [
+        "../include"
+      ],
+      "libraries": [ "-luv" ],
+      "cflags_cc!": [ "-fno-rtti", "-fno-exceptions" ],
+      "cflags_cc": [ "-std=c++14" ],
+      "conditions": [
+        ['OS=="mac"', {
+          "xcode_settings": {
+            "OTHER_CPLUSPLUSFLAGS" : [ "-std=c++14" ],
+            "GCC_ENABLE_CPP_EXCEPTIONS": "YES",
+            "GCC_ENABLE_CPP_RTTI": "YES"
+          }
+        }]
+      ]
+    },
+  ]
+}
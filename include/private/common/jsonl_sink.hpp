@@ -0,0 +1,212 @@
+// Part of measurement-kit <https://measurement-kit.github.io/>.
+// Measurement-kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef PRIVATE_COMMON_JSONL_SINK_HPP
+#define PRIVATE_COMMON_JSONL_SINK_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace mk {
+
+/// # JsonlSink
+///
+/// JsonlSink appends lines (e.g. JSON entries) to a file, one per line, using
+/// a dedicated writer thread. Threads calling append() only copy the line
+/// into a buffer, while the writer thread writes all the lines accumulated
+/// meanwhile with a single write() call, so that bursts of lines cost a few
+/// large writes rather than many small ones.
+///
+/// When the file would grow larger than `rotate_bytes`, it is renamed to
+/// `path.1` (`path.1` to `path.2`, and so on, up to `rotate_count` old
+/// files, deleting the oldest one) and a new file is opened. We keep at
+/// least one old file, even if `rotate_count` is zero, because otherwise
+/// each rotation would discard all the lines written so far. Lines are never
+/// split across files.
+///
+/// Errors occurring in the writer thread cannot be reported to the caller,
+/// hence they are counted in `failures` and the lines are dropped.
+class JsonlSink {
+  public:
+    /// Fsync tells when the writer thread calls fsync(): never, after each
+    /// batch of lines, or after each line.
+    enum class Fsync { none, batch, always };
+
+    /// The constructor opens `path` for appending and starts the writer
+    /// thread. It throws std::runtime_error if `path` cannot be opened.
+    JsonlSink(std::string path, uint64_t rotate_bytes, uint64_t rotate_count,
+            Fsync fsync)
+        : path{std::move(path)}, rotate_bytes{rotate_bytes},
+          rotate_count{(std::max)(rotate_count, (uint64_t)1)}, fsync{fsync} {
+        if (!open(O_APPEND)) {
+            throw std::runtime_error("cannot open entry sink");
+        }
+        writer = std::thread{[this]() { loop(); }};
+    }
+
+    /// The destructor writes the lines not written yet and then stops the
+    /// writer thread and closes the file.
+    ~JsonlSink() {
+        {
+            std::unique_lock<std::mutex> _{mutex};
+            stopping = true;
+        }
+        cond.notify_one();
+        writer.join();
+        if (fd != -1) {
+            ::close(fd);
+        }
+    }
+
+    /// The append() method queues `line` to be written. It is safe to call
+    /// this method concurrently from many threads.
+    void append(const std::string &line) {
+        {
+            std::unique_lock<std::mutex> _{mutex};
+            pending.append(line);
+            pending.push_back('\n');
+        }
+        cond.notify_one();
+    }
+
+    /// The flush() method blocks until all the lines queued so far have been
+    /// written, e.g. to make sure they are on disk before telling the user
+    /// that the test is over.
+    void flush() {
+        std::unique_lock<std::mutex> lock{mutex};
+        idle.wait(lock, [this]() { return pending.empty() && !busy; });
+    }
+
+    /// The failures field counts the write errors.
+    std::atomic<uint64_t> failures{0};
+
+  private:
+    // Opens `path` with the additional `flags`, and sets `size` to the
+    // number of bytes already in the file.
+    bool open(int flags) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | flags, 0644);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat st {};
+        size = (::fstat(fd, &st) == 0) ? (uint64_t)st.st_size : 0;
+        return true;
+    }
+
+    // Renames the current and old files and opens a new file.
+    void rotate() {
+        ::close(fd);
+        for (uint64_t i = rotate_count - 1; i > 0; --i) {
+            std::string from = path + "." + std::to_string(i);
+            std::string to = path + "." + std::to_string(i + 1);
+            (void)std::rename(from.c_str(), to.c_str());
+        }
+        (void)std::rename(path.c_str(), (path + ".1").c_str());
+        if (!open(O_TRUNC)) {
+            failures += 1;
+        }
+    }
+
+    // Writes `count` bytes starting at `data`, retrying on short writes.
+    void write_all(const char *data, size_t count) {
+        while (count > 0 && fd != -1) {
+            ssize_t n = ::write(fd, data, count);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                failures += 1;
+                return;
+            }
+            data += n, count -= (size_t)n, size += (uint64_t)n;
+        }
+    }
+
+    // Writes the lines in `writing`, rotating when needed. We write as many
+    // lines as possible with a single write() call, unless we must fsync()
+    // after each of them.
+    void write_lines() {
+        size_t begin = 0;
+        while (begin < writing.size()) {
+            if (fd == -1 && !open(O_APPEND)) {
+                failures += 1;
+                return;
+            }
+            size_t end = begin;
+            for (;;) {
+                size_t next = writing.find('\n', end) + 1;
+                // Note: into an empty file we always write at least one
+                // line, otherwise a line longer than rotate_bytes would
+                // never be written
+                if (rotate_bytes != 0 && size + (next - begin) > rotate_bytes &&
+                        (size != 0 || end != begin)) {
+                    break;
+                }
+                end = next;
+                if (end == writing.size() || fsync == Fsync::always) {
+                    break;
+                }
+            }
+            if (end == begin) {
+                rotate();
+                continue;
+            }
+            write_all(writing.data() + begin, end - begin);
+            if (fsync == Fsync::always) {
+                (void)::fsync(fd);
+            }
+            begin = end;
+        }
+        if (fsync == Fsync::batch && fd != -1) {
+            (void)::fsync(fd);
+        }
+    }
+
+    // The writer thread's main loop.
+    void loop() {
+        std::unique_lock<std::mutex> lock{mutex};
+        for (;;) {
+            cond.wait(lock, [this]() { return stopping || !pending.empty(); });
+            if (pending.empty()) {
+                return;
+            }
+            std::swap(pending, writing);
+            busy = true;
+            lock.unlock();
+            write_lines();
+            writing.clear();
+            lock.lock();
+            busy = false;
+            idle.notify_all();
+        }
+    }
+
+    std::string path;
+    uint64_t rotate_bytes = 0;
+    uint64_t rotate_count = 0;
+    Fsync fsync = Fsync::none;
+    int fd = -1;
+    uint64_t size = 0;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::condition_variable idle;
+    std::string pending;
+    std::string writing;
+    bool busy = false;
+    bool stopping = false;
+    std::thread writer;
+};
+
+} // namespace mk
+#endif
@@ -0,0 +1,106 @@
+// Part of measurement-kit <https://measurement-kit.github.io/>.
+// Measurement-kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef PRIVATE_COMMON_LOG_RING_HPP
+#define PRIVATE_COMMON_LOG_RING_HPP
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace mk {
+
+/// # LogRing
+///
+/// LogRing keeps the most recent log lines of a test in memory, so that they
+/// can be fetched on demand (e.g. when the test fails) rather than being
+/// delivered one by one. Lines are numbered in order, starting from one, so
+/// that readers can ask for the lines following the last one they have seen.
+///
+/// The ring is bounded by number of lines, by number of bytes, or by both
+/// (a zero bound means no bound). The oldest lines are evicted first, except
+/// that the newest line is always kept, even if it is larger than the bound
+/// on bytes. Evicted lines lend their buffers to new lines, so that a full
+/// ring does not allocate for lines that are not longer than the evicted
+/// ones.
+class LogRing {
+  public:
+    /// # Line
+    ///
+    /// Line is a log line kept by the ring.
+    class Line {
+      public:
+        /// The seq field is the number of the line.
+        uint64_t seq = 0;
+
+        /// The level field is the level of the line.
+        uint32_t level = 0;
+
+        /// The message field is the text of the line.
+        std::string message;
+    };
+
+    /// The constructor sets the bounds of the ring.
+    LogRing(uint64_t max_lines, uint64_t max_bytes)
+        : max_lines{max_lines}, max_bytes{max_bytes} {}
+
+    /// The push() method appends a line, evicting old lines if needed. It is
+    /// safe to call this method concurrently from many threads.
+    void push(uint32_t level, const char *message) {
+        std::unique_lock<std::mutex> _{mutex};
+        std::string buffer;
+        if (max_lines != 0 && lines.size() >= max_lines) {
+            buffer = evict();
+        }
+        buffer.assign(message);
+        bytes += buffer.size();
+        lines.push_back(Line{});
+        lines.back().seq = ++last;
+        lines.back().level = level;
+        lines.back().message = std::move(buffer);
+        while (max_bytes != 0 && bytes > max_bytes && lines.size() > 1) {
+            (void)evict();
+        }
+    }
+
+    /// The get() method copies into `out` at most `max_count` lines (all of
+    /// them if zero) among those whose number is greater than `since`, from
+    /// the oldest one, and returns the number of such lines that have been
+    /// evicted before being read.
+    uint64_t get(uint64_t since, uint64_t max_count, std::vector<Line> &out) {
+        std::unique_lock<std::mutex> _{mutex};
+        uint64_t first = last + 1 - lines.size();
+        uint64_t missed = (since + 1 < first) ? first - since - 1 : 0;
+        size_t begin = (since >= first) ? (size_t)(since - first + 1) : 0;
+        size_t end = lines.size();
+        if (max_count != 0 && begin < end && end - begin > max_count) {
+            end = begin + (size_t)max_count;
+        }
+        for (size_t i = begin; i < end; ++i) {
+            out.push_back(lines[i]);
+        }
+        return missed;
+    }
+
+  private:
+    // Removes the oldest line and returns its buffer.
+    std::string evict() {
+        std::string buffer = std::move(lines.front().message);
+        lines.pop_front();
+        bytes -= buffer.size();
+        return buffer;
+    }
+
+    uint64_t max_lines = 0;
+    uint64_t max_bytes = 0;
+    std::mutex mutex;
+    std::deque<Line> lines;
+    uint64_t bytes = 0;
+    uint64_t last = 0;
+};
+
+} // namespace mk
+#endif
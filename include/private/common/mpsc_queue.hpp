@@ -0,0 +1,129 @@
+// Part of measurement-kit <https://measurement-kit.github.io/>.
+// Measurement-kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef PRIVATE_COMMON_MPSC_QUEUE_HPP
+#define PRIVATE_COMMON_MPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace mk {
+
+/// # MpscQueue
+///
+/// MpscQueue is a bounded, lock-free, multi-producer single-consumer queue
+/// based on Dmitry Vyukov's bounded MPMC queue design. Each cell carries a
+/// sequence number telling producers and the consumer whether the cell is
+/// free or full for the current lap around the ring, so that neither side
+/// needs a lock. Since we have a single consumer, the read position is a
+/// plain integer owned by the consumer thread.
+///
+/// The capacity is rounded up to the next power of two. Cells are allocated
+/// once at construction, hence pushing and popping never allocate (moving
+/// `T` into a cell may still allocate depending on `T`).
+template <typename T> class MpscQueue {
+  public:
+    /// The constructor allocates all the cells of the ring.
+    explicit MpscQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        cells.reset(new Cell[size]);
+        for (size_t i = 0; i < size; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        mask = size - 1;
+    }
+
+    /// The try_push() method moves `value` into the queue and returns true,
+    /// or returns false, leaving `value` untouched, if the queue is full. It
+    /// is safe to call this method concurrently from many threads.
+    bool try_push(T &&value) {
+        return try_push_with([&value](T &cell) { cell = std::move(value); });
+    }
+
+    /// The try_push_with() method is like try_push() except that it calls
+    /// `fill` to write the new element in place, on top of the element that
+    /// previously occupied the same cell. This allows, e.g., to reuse buffers
+    /// already allocated by the previous element.
+    template <typename Fill> bool try_push_with(Fill &&fill) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(
+                            pos, pos + 1, std::memory_order_relaxed)) {
+                    fill(cell.value);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// The try_pop() method moves the oldest element into `value` and returns
+    /// true, or returns false if the queue is empty. Only the consumer thread
+    /// may call this method.
+    bool try_pop(T &value) {
+        return try_consume([&value](T &cell) { value = std::move(cell); });
+    }
+
+    /// The try_consume() method is like try_pop() except that it calls
+    /// `consume` on the oldest element in place, and then frees its cell,
+    /// leaving the element there to be overwritten by a later push.
+    template <typename Consume> bool try_consume(Consume &&consume) {
+        Cell &cell = cells[head & mask];
+        size_t seq = cell.sequence.load(std::memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(head + 1) < 0) {
+            return false;
+        }
+        consume(cell.value);
+        cell.sequence.store(head + mask + 1, std::memory_order_release);
+        ++head;
+        return true;
+    }
+
+    /// The peek() method returns the oldest element, leaving it in the queue,
+    /// or nullptr if the queue is empty. Only the consumer thread may call
+    /// this method, and the element stays valid until it is consumed.
+    T *peek() {
+        Cell &cell = cells[head & mask];
+        size_t seq = cell.sequence.load(std::memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(head + 1) < 0) {
+            return nullptr;
+        }
+        return &cell.value;
+    }
+
+    /// The capacity() method returns the number of cells in the ring.
+    size_t capacity() const { return mask + 1; }
+
+  private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    // Note: padding keeps the producers' cache line (tail) away from the
+    // consumer's one (head), otherwise they would keep stealing it from
+    // each other. We don't use alignas() since C++14 `new` ignores it.
+    std::unique_ptr<Cell[]> cells;
+    size_t mask = 0;
+    char pad0_[64];
+    std::atomic<size_t> tail{0};
+    char pad1_[64];
+    size_t head = 0;
+};
+
+} // namespace mk
+#endif
@@ -0,0 +1,105 @@
+// Part of measurement-kit <https://measurement-kit.github.io/>.
+// Measurement-kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef PRIVATE_COMMON_THROUGHPUT_SAMPLER_HPP
+#define PRIVATE_COMMON_THROUGHPUT_SAMPLER_HPP
+
+#include "private/common/compat.hpp"
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace mk {
+
+/// # ThroughputSampler
+///
+/// ThroughputSampler turns the speed events emitted by throughput oriented
+/// tests (e.g. `{"type": "download-speed", "elapsed": [1.5, "s"], "speed":
+/// [9000.0, "kbit/s"]}`) into a time series of samples, each made of three
+/// numbers: the milliseconds since the test started, and the bytes received
+/// and sent so far.
+///
+/// Since MK does not expose byte counters while a test is running, bytes are
+/// estimated by integrating the reported speed over the elapsed time between
+/// two events of the same direction. A sample is taken at most once every
+/// `interval_ns`, when an event arrives, so samples are as frequent as MK's
+/// events allow, but never more.
+///
+/// Samples are written by MK's thread and taken in bulk by the thread that
+/// delivers them, so the time series is stored as a flat array of doubles
+/// that can be copied as is into a typed array.
+class ThroughputSampler {
+  public:
+    /// The constructor sets the minimum interval between samples.
+    explicit ThroughputSampler(uint64_t interval_ns)
+        : interval_ns{interval_ns} {}
+
+    /// The start() method tells that the test started at `now_ns`.
+    void start(uint64_t now_ns) {
+        std::unique_lock<std::mutex> _{mutex};
+        started_ns = now_ns;
+    }
+
+    /// The on_event() method processes the event `s`, emitted at `now_ns`,
+    /// and returns true if it has taken a new sample. Events that are not
+    /// speed events are ignored.
+    bool on_event(const char *s, uint64_t now_ns) {
+        int direction = 0;
+        double elapsed = 0.0, kbits = 0.0;
+        try {
+            Json event = Json::parse(s);
+            std::string type = event.at("type");
+            if (type == "download-speed") {
+                direction = 0;
+            } else if (type == "upload-speed") {
+                direction = 1;
+            } else {
+                return false;
+            }
+            elapsed = event.at("elapsed").at(0);
+            kbits = event.at("speed").at(0);
+        } catch (const std::exception &) {
+            return false;
+        }
+        std::unique_lock<std::mutex> _{mutex};
+        // Note: `elapsed` restarts from zero at each phase of the test
+        double delta = elapsed - last_elapsed[direction];
+        if (delta < 0.0) {
+            delta = elapsed;
+        }
+        last_elapsed[direction] = elapsed;
+        bytes[direction] += kbits * 125.0 * delta;
+        if (sampled && now_ns - sampled_ns < interval_ns) {
+            return false;
+        }
+        sampled = true;
+        sampled_ns = now_ns;
+        samples.push_back((double)(now_ns - started_ns) / 1e06);
+        samples.push_back(bytes[0]);
+        samples.push_back(bytes[1]);
+        return true;
+    }
+
+    /// The take() method moves the samples taken so far into `out`, which
+    /// is cleared first.
+    void take(std::vector<double> &out) {
+        out.clear();
+        std::unique_lock<std::mutex> _{mutex};
+        std::swap(samples, out);
+    }
+
+  private:
+    uint64_t interval_ns = 0;
+    std::mutex mutex;
+    uint64_t started_ns = 0;
+    bool sampled = false;
+    uint64_t sampled_ns = 0;
+    double last_elapsed[2] = {0.0, 0.0};
+    double bytes[2] = {0.0, 0.0};
+    std::vector<double> samples;
+};
+
+} // namespace mk
+#endif
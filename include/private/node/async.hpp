@@ -5,9 +5,19 @@
 #define PRIVATE_NODE_SYNC_HPP
 
 #include "private/common/compat.hpp"
+#include "private/common/mpsc_queue.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <list>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <uv.h>
+#include <vector>
 
 /// # async
 ///
@@ -28,37 +38,60 @@
 /// heap and managed through SharedPtr, a null-safe shared pointer.
 ///
 /// ```C++
-///   auto async_ctx = mk::node::async::make<>().
+///   auto async_ctx = mk::node::async::make<>(loop).
 /// ```
 ///
+/// where `loop` is the libuv loop of the calling thread, e.g. what is returned
+/// by `Nan::GetCurrentEventLoop()`. This matters when we are loaded by worker
+/// threads, because each of them runs its own loop.
+///
+/// Before using the Context, set its `dispatch` field to a function that will
+/// be called in the context of libuv loop to deliver typed events, i.e. Event
+/// records. Inside such function you can safely call Node APIs.
+///
 /// When you register a callback for an MK test, copy the shared pointer into
 /// the lambda closure. When the callback is invoked by MK, you should call
-/// suspend<>() passing it a lambda in which closure you should store arguments
-/// received by MK's callback. Make sure that tempory arguments like pointers
-/// are made persistent to the lambda by creating copies. For example:
+/// emit<>() passing it the event type and a lambda that copies the arguments
+/// received by MK's callback into the Event record. Make sure that tempory
+/// arguments like pointers are made persistent by creating copies. Event
+/// records live in a preallocated queue and are overwritten in place, so
+/// that in steady state this does not allocate. For example:
 ///
 /// ```C++
 ///   test.on_log([async_ctx](uint32_t level, const char *s) {
-///       mk::node::async::suspend<>(async_ctx, [level, msg = std::string(s)] {
-///           // Here you can use level and msg with Node's C++ API.
-///       });
+///       mk::node::async::emit<>(async_ctx, mk::node::async::EventType::log,
+///               [&](mk::node::async::Event &ev) {
+///                   ev.level = level;
+///                   ev.payload.assign(s);
+///               });
 ///   });
 /// ```
 ///
-/// Internally, suspend<>() will wakeup the libuv loop. This means that
-/// eventually the suspended lambda will be called in the context of libuv
-/// loop. Inside such lambda you can safely call Node APIs.
+/// Internally, emit<>() will wakeup the libuv loop. This means that eventually
+/// `dispatch` will be called in the context of libuv loop with the Event. For
+/// the rare cases in which you need to run arbitrary code in the context of
+/// libuv loop, you can also call suspend<>() passing it a lambda.
+///
+/// Events are not necessarily delivered in the order in which they have been
+/// emitted: the end of the test is delivered before pending entries, which
+/// are delivered before pending progress events and log lines. However, the
+/// end of the test never overtakes entries, progress, events and data usage,
+/// and closures never overtake any event. See Priority and barrier_of() for
+/// more details.
 ///
-/// When you create a Context, this will register a pointer to its
-/// `uv_async_t` field as a libuv handle with libuv's default loop. This implies
-/// that libuv's loop will not exit as long as this handle is active. So
-/// to avoid libuv's loop to run forever, we need to understand also how to
-/// unregister such handle when we are done.
+/// All the Contexts created on a loop share a single Dispatcher owning the only
+/// `uv_async_t` registered with such loop. A Context is just a lightweight
+/// channel registered with the Dispatcher, and one wakeup of the loop drains
+/// all the channels. The Dispatcher keeps its handle referenced
+/// only as long as there are live channels, therefore libuv's loop will not
+/// exit as long as some Context is registered. So to avoid libuv's loop to
+/// run forever, we need to understand also how to unregister a Context when
+/// we are done.
 ///
 /// To understand that, we need to understand all the copies of the shared
 /// pointer that are keeping it alive. We have one copy for each callback
 /// we registered on the test (as shown above). Plus, we have one extra copy
-/// meant to represent the fact that libuv is using the Context.
+/// meant to represent the fact that the Dispatcher is using the Context.
 ///
 /// In measurement-kit >= v0.8.0, the way in which we internally run the test
 /// should be such that, using the above pattern, the test should correctly
@@ -68,8 +101,8 @@
 /// To remove such last copy, register a `on_destroy` handler for the test. This
 /// will be triggered at the end of the test, as explained above. Pass to this
 /// method a lambda referencing the shared pointer. This lambda must call the
-/// start_delete() method. This method will internally make sure that libuv
-/// knows we don't need the async handle anymore and clean it up.
+/// start_delete() method. This method will internally make sure that the
+/// Dispatcher knows we don't need the channel anymore and forget about it.
 ///
 /// ```C++
 ///     test.on_destroy([async_ctx]() {
@@ -81,11 +114,16 @@
 /// correctly leave after the test is over. Otherwise, if you find Node stuck,
 /// the first thing you should check is whether the internal test object is
 /// actually destroyed (i.e. whether on_destroy is called).
+///
+/// When a loop is about to be closed (e.g. because a worker thread is exiting)
+/// call close<>() to close its Dispatcher. From then on, the events suspended
+/// by tests still running on such loop are never delivered.
 
 extern "C" {
 // Functions declared as extern C because the C++ FAQ recommends that the
 // code called from C must be as such to maximize portability.
 static inline void mkuv_resume(uv_async_t *handle);
+static inline void mkuv_expire(uv_timer_t *handle);
 static inline void mkuv_delete(uv_handle_t *handle);
 }
 
@@ -93,6 +131,386 @@ namespace mk {
 namespace node {
 namespace async {
 
+/// ## EventClass
+///
+/// EventClass is the class of the event delivered by a suspended function,
+/// which we use to bound the queue. Only the classes before `other` can be
+/// bounded, because losing any other event (e.g. an entry) is not acceptable.
+enum class EventClass { log = 0, event = 1, progress = 2, other = 3 };
+
+/// ## Limit
+///
+/// Limit bounds the number of events of a given class that are suspended
+/// and not yet resumed, and counts the events that have been dropped.
+///
+/// ### Fields
+class Limit {
+  public:
+    /// The max field is the maximum number of pending events, after which we
+    /// start dropping events. Zero means unbounded. It must be configured
+    /// before the test starts and must not be changed afterwards.
+    uint64_t max = 0;
+
+    /// The sample_every field tells us to keep one event every `sample_every`
+    /// events past the limit rather than dropping all of them. Zero means
+    /// that we drop all of them. The same restrictions of `max` apply.
+    uint64_t sample_every = 0;
+
+    /// The pending field counts events suspended and not yet resumed.
+    std::atomic<uint64_t> pending{0};
+
+    /// The overflowed field counts events suspended past the limit.
+    std::atomic<uint64_t> overflowed{0};
+
+    /// The dropped field counts events that have been dropped.
+    std::atomic<uint64_t> dropped{0};
+};
+
+/// ## Limits
+///
+/// Limits contains a Limit for each class of events that we can bound. It
+/// lives in its own object, so that it can be inspected after the Context
+/// has been deleted.
+class Limits {
+  public:
+    /// The by_class field is indexed by EventClass.
+    Limit by_class[(int)EventClass::other];
+};
+
+/// ## EventType
+///
+/// EventType is the type of an Event. All types except `closure` correspond
+/// to an MK callback, while `closure` means that we should run the function
+/// stored into the Event.
+enum class EventType {
+    closure,
+    begin,
+    end,
+    entry,
+    event,
+    log,
+    progress,
+    data_usage,
+    final
+};
+
+/// class_of() returns the class of events of type `type`.
+static inline EventClass class_of(EventType type) {
+    switch (type) {
+    case EventType::log:
+        return EventClass::log;
+    case EventType::event:
+        return EventClass::event;
+    case EventType::progress:
+        return EventClass::progress;
+    default:
+        return EventClass::other;
+    }
+}
+
+/// ## Priority
+///
+/// Priority is the lane in which events are queued. Lanes are drained in
+/// order of priority, so that, e.g., the end of a test is not delivered after
+/// thousands of log lines queued before it. Within a lane, events are FIFO.
+enum class Priority { control = 0, entry = 1, progress = 2, log = 3 };
+
+/// The lane_count constant is the number of priorities.
+constexpr size_t lane_count = 4;
+
+/// priority_of() returns the priority of events of type `type`.
+static inline Priority priority_of(EventType type) {
+    switch (type) {
+    case EventType::entry:
+        return Priority::entry;
+    case EventType::event:
+    case EventType::progress:
+    case EventType::data_usage:
+        return Priority::progress;
+    case EventType::log:
+        return Priority::log;
+    default:
+        return Priority::control;
+    }
+}
+
+/// barrier_of() returns the mask of the lanes whose events suspended before
+/// an event of type `type` must be delivered before it. The end of the test
+/// and the final callback must not overtake entries, nor progress, events
+/// and data usage, since users read the latter (e.g. the data usage) once
+/// the test is over. Only log lines may be delivered after the end of the
+/// test. Closures (e.g. the one deleting the Context) must not overtake
+/// anything.
+static inline unsigned barrier_of(EventType type) {
+    switch (type) {
+    case EventType::closure:
+        return (1 << lane_count) - 1;
+    case EventType::end:
+    case EventType::final:
+        return (1 << (int)Priority::entry) | (1 << (int)Priority::progress);
+    default:
+        return 0;
+    }
+}
+
+/// ## Event
+///
+/// Event is the compact record that MK threads push for libuv's thread.
+/// Records are overwritten in place, hence producers must set all the fields
+/// used by the type of event they push, and consumers must only read those.
+///
+/// ### Fields
+class Event {
+  public:
+    /// The type field is the type of the event.
+    EventType type = EventType::closure;
+
+    /// The level field is the log level of `log` events.
+    uint32_t level = 0;
+
+    /// The enqueued_at field is the uv_hrtime() when the event was suspended.
+    uint64_t enqueued_at = 0;
+
+    /// The seq field orders the events suspended on a Context across lanes.
+    uint64_t seq = 0;
+
+    /// The values field contains the percentage of `progress` events and the
+    /// bytes down and up of `data_usage` events.
+    double values[2] = {0.0, 0.0};
+
+    /// The payload field is the string argument of the event, if any. Since
+    /// records are reused, its buffer is reused as well, unless it grows
+    /// larger than `max_retained_payload`.
+    std::string payload;
+
+    /// The tree field is the parsed JSON of `entry` events, when they are
+    /// parsed by MK threads rather than delivered as strings. It is reset
+    /// once the event has been delivered, so it does not pin memory.
+    Json tree;
+
+    /// The func field is the function to run for `closure` events.
+    std::function<void()> func;
+};
+
+/// The max_retained_payload constant is the size of the largest payload
+/// buffer that we keep around for reuse after delivering an event. Larger
+/// buffers (e.g. big entries) are freed, so they do not pin memory.
+constexpr size_t max_retained_payload = 4096;
+
+/// ## Histogram
+///
+/// Histogram counts durations using buckets whose bounds are powers of two
+/// microseconds. Bucket zero counts durations shorter than one microsecond,
+/// bucket `i` counts durations in [2^(i-1), 2^i) microseconds, and the last
+/// bucket also counts all the longer durations.
+///
+/// ### Fields
+class Histogram {
+  public:
+    /// The size constant is the number of buckets.
+    static constexpr size_t size = 24;
+
+    /// The buckets field contains the counters.
+    uint64_t buckets[size] = {};
+
+    /// The record() method counts a duration of `ns` nanoseconds.
+    void record(uint64_t ns) {
+        uint64_t us = ns / 1000;
+        size_t i = 0;
+        while (us != 0 && i < size - 1) {
+            us >>= 1;
+            ++i;
+        }
+        buckets[i] += 1;
+    }
+};
+
+/// ## Stats
+///
+/// Stats contains the counters of a Context. It lives in its own object, so
+/// that it can be inspected after the Context has been deleted. MK threads
+/// only write the atomic fields, all the others are only accessed by libuv's
+/// thread.
+///
+/// ### Fields
+class Stats {
+  public:
+    /// The events field counts the events suspended on the Context.
+    std::atomic<uint64_t> events{0};
+
+    /// The wakeups field counts the uv_async_send() calls actually issued
+    /// while suspending such events. It is lower than `events` because we
+    /// skip the call when a wakeup is already pending.
+    std::atomic<uint64_t> wakeups{0};
+
+    /// The resumed field counts the events delivered. It is atomic because
+    /// MK threads read it to compute the queue depth.
+    std::atomic<uint64_t> resumed{0};
+
+    /// The coalesced field counts the events that replaced an undelivered
+    /// one in a Slot, and that were therefore not counted in `events`.
+    std::atomic<uint64_t> coalesced{0};
+
+    /// The max_depth field is the high-water mark of the number of events
+    /// suspended and not yet delivered. Since MK threads compute the depth
+    /// without locking, it is approximate when many threads are suspending.
+    std::atomic<uint64_t> max_depth{0};
+
+    /// The passes field counts the drain passes that delivered events.
+    uint64_t passes = 0;
+
+    /// The max_pass_events field is the largest number of events delivered
+    /// by a single drain pass.
+    uint64_t max_pass_events = 0;
+
+    /// The callback_ns field is the time spent delivering events, i.e. mostly
+    /// inside JavaScript callbacks, in nanoseconds.
+    uint64_t callback_ns = 0;
+
+    /// The latency field is the histogram of the time between suspending an
+    /// event and starting to deliver it.
+    Histogram latency;
+};
+
+/// accumulate() adds the counters in `stats` to `total`, taking the maximum
+/// of the high-water marks. It must be called by libuv's thread.
+static inline void accumulate(Stats &total, const Stats &stats) {
+    total.events += stats.events;
+    total.wakeups += stats.wakeups;
+    total.resumed += stats.resumed;
+    total.coalesced += stats.coalesced;
+    total.max_depth = (std::max)(total.max_depth.load(), stats.max_depth.load());
+    total.passes += stats.passes;
+    total.max_pass_events =
+            (std::max)(total.max_pass_events, stats.max_pass_events);
+    total.callback_ns += stats.callback_ns;
+    for (size_t i = 0; i < Histogram::size; ++i) {
+        total.latency.buckets[i] += stats.latency.buckets[i];
+    }
+}
+
+class Dispatcher;
+
+/// ## Lane
+///
+/// Lane is the FIFO of the events of a given priority suspended on a Context.
+/// In the common case, events go into a lock-free queue that MK threads push
+/// into and libuv's thread drains without locking. The queue is allocated
+/// when the first event is suspended, so that tests that never run, or that
+/// never suspend events of such priority, do not pay for it.
+///
+/// ### Fields
+class Lane {
+  public:
+    /// The constructor sets the capacity of the queue.
+    Lane(size_t capacity) : capacity{capacity} {}
+
+    /// The capacity field is the number of events of the queue.
+    size_t capacity = 0;
+
+    /// The allocated flag guarantees that `storage` is allocated once.
+    std::once_flag allocated;
+
+    /// The storage field owns the lock-free queue, once allocated.
+    std::unique_ptr<MpscQueue<Event>> storage;
+
+    /// The suspended field is the lock-free queue of suspended events, or
+    /// nullptr until the first event is suspended on this lane.
+    std::atomic<MpscQueue<Event> *> suspended{nullptr};
+
+    /// The overflowing flag tells producers that `suspended` was found full
+    /// and that, until libuv's thread catches up, they must append to the
+    /// overflow list instead, so that per-thread ordering is preserved. We
+    /// do not block producers when `suspended` is full because libuv's
+    /// thread may be busy for long; when it is waiting for a test to finish,
+    /// the Context's Gate, if any, blocks producers instead.
+    std::atomic<bool> overflowing{false};
+
+    /// The overflow_mutex protects the overflow list.
+    std::mutex overflow_mutex;
+
+    /// The overflow field is the slow path list of suspended events.
+    std::list<Event> overflow;
+
+    /// The resuming field contains events taken from the overflow list
+    /// that we did not deliver yet. Only libuv's thread can access it.
+    std::list<Event> resuming;
+
+    /// The head field is the oldest event, as returned by front(), until it
+    /// is removed by pop(), and head_in_queue tells whether it lives in
+    /// `suspended` or in `resuming`. Only libuv's thread can access them.
+    Event *head = nullptr;
+    bool head_in_queue = false;
+};
+
+/// ## Slot
+///
+/// Slot contains the latest value of an event type whose events are state
+/// snapshots, such as progress, when the Context coalesces them. Producers
+/// overwrite the value and libuv's thread delivers it at most once per pass.
+///
+/// ### Fields
+class Slot {
+  public:
+    /// The mutex protects `latest` and `pending`.
+    std::mutex mutex;
+
+    /// The latest field is the latest value written by producers.
+    Event latest;
+
+    /// The pending field tells whether `latest` has not been delivered yet.
+    bool pending = false;
+
+    /// The delivering field is where libuv's thread moves `latest` before
+    /// delivering it, so that both buffers are reused. Only libuv's thread
+    /// can access it.
+    Event delivering;
+
+    /// The delivered_at field is the uv_hrtime() of the latest delivery. Only
+    /// libuv's thread can access it.
+    uint64_t delivered_at = 0;
+};
+
+/// ## Gate
+///
+/// Gate is used when libuv's thread blocks until a test is over, as in
+/// run(), and drains the events of the test meanwhile. Producers wakeup
+/// such thread, rather than libuv's loop, and they block when `capacity`
+/// events are pending, so that memory stays bounded. Coalesced events do not
+/// count, since they are bounded anyway. Once the test is over, the Gate is
+/// open and producers use the loop again, e.g. to unregister the Context.
+///
+/// ### Fields
+class Gate {
+  public:
+    /// The constructor sets the maximum number of pending events.
+    explicit Gate(uint64_t capacity) : capacity{capacity} {}
+
+    /// The capacity field is the maximum number of pending events.
+    uint64_t capacity = 0;
+
+    /// The mutex protects all the fields below.
+    std::mutex mutex;
+
+    /// The ready condition is signalled when events are suspended or the
+    /// test is over, and the space condition when events are drained.
+    std::condition_variable ready;
+    std::condition_variable space;
+
+    /// The pending field is the number of pending events.
+    uint64_t pending = 0;
+
+    /// The woken field tells whether events have been suspended since the
+    /// blocked thread last checked.
+    bool woken = false;
+
+    /// The finished field tells whether the test is over.
+    bool finished = false;
+
+    /// The open field tells whether the blocked thread stopped draining.
+    bool open = false;
+};
+
 /// ## Context
 ///
 /// Context is the class containing all the variables we need. It is a class
@@ -101,57 +519,813 @@ namespace async {
 /// ### Fields
 class Context {
   public:
-    /// The `async` structure is used to wakeup libuv's event loop and running
-    /// callbacks in its context. Since uv_async_init() until finish_delete()
-    /// we must not delete the Context class. The existence of a registered
-    /// `uv_async_t *` will also prevent uv_loop() from exiting. We must init
-    /// this field explicitly because it's a piece of POD.
+    /// The `disp` field points to the Dispatcher, whose handle we use to
+    /// wakeup libuv's event loop and run callbacks in its context. We keep it
+    /// alive, since MK threads may outlive the loop.
+    SharedPtr<Dispatcher> disp;
+
+    /// The `self` field is the position of this Context in the Dispatcher's
+    /// list of channels, used to unregister in constant time.
+    std::list<SharedPtr<Context>>::iterator self;
+
+    /// The lanes field contains a Lane for each Priority. Lanes of events
+    /// that are seldom suspended have smaller queues, and queues are only
+    /// allocated when used (see Lane).
+    Lane lanes[lane_count]{{64}, {256}, {256}, {1024}};
+
+    /// The coalesce field tells whether progress and data usage events must
+    /// be coalesced, such that only the latest value is delivered, at most
+    /// once per pass and once every `coalesce_interval_ns`. It must be set
+    /// before the test starts and must not be changed afterwards.
+    bool coalesce = false;
+    uint64_t coalesce_interval_ns = 0;
+
+    /// The latest field contains the slots for progress and data usage
+    /// events, used when `coalesce` is set.
+    Slot latest[2];
+
+    /// The held_until field is the uv_hrtime() at which the values held back
+    /// in `latest` because of the coalescing interval must be delivered, or
+    /// zero if none is held back. Only libuv's thread can access it.
+    uint64_t held_until = 0;
+
+    /// The dispatch field is the function called by libuv's thread to deliver
+    /// events other than closures. Only libuv's thread can access it.
+    std::function<void(Event &)> dispatch;
+
+    /// The limits field bounds the number of pending events per class.
+    SharedPtr<Limits> limits{new Limits};
+
+    /// The stats field contains the counters of this Context.
+    SharedPtr<Stats> stats{new Stats};
+
+    /// The stopped flag tells that the events of this Context, other than
+    /// closures and the final event, must not be suspended or delivered
+    /// anymore, because the user is not interested in them. Like `limits`
+    /// and `stats`, it is shared so it can be set after the test started.
+    SharedPtr<std::atomic<bool>> stopped{new std::atomic<bool>{false}};
+
+    /// The gate field, if set, is the Gate of the thread blocked until the
+    /// test is over. It must be set before the test starts and must not be
+    /// changed afterwards.
+    SharedPtr<Gate> gate;
+
+    /// The on_drained field contains functions that drain() calls after it
+    /// has delivered all the events suspended on this Context, e.g. to deliver
+    /// at once data accumulated while dispatching them. Only libuv's thread can
+    /// access this field.
+    std::vector<std::function<void()>> on_drained;
+};
+
+/// ## DrainPolicy
+///
+/// DrainPolicy tells how much work we can do each time libuv's loop wakes us
+/// up. When the budget is over, we stop and wakeup the loop again, so that
+/// other I/O is served before we continue. When adaptive, the time budget is
+/// a slice that adapts to the event loop lag, measured as the time between
+/// the moment in which we stopped and the next wakeup. If the loop was busy
+/// for longer than our slice, we halve the slice, otherwise we double it, up
+/// to `max_time_ns`. When the loop is idle, we use the whole budget.
+///
+/// ### Fields
+class DrainPolicy {
+  public:
+    /// The max_events field is the maximum number of events delivered per
+    /// wakeup. Zero means unbounded.
+    uint64_t max_events = 0;
+
+    /// The max_time_ns field is the maximum time spent per wakeup, in
+    /// nanoseconds. Zero means unbounded.
+    uint64_t max_time_ns = 0;
+
+    /// The adaptive field tells whether to adapt the time slice to the lag.
+    bool adaptive = false;
+
+    /// The slice_ns field is the current adaptive time slice.
+    uint64_t slice_ns = 0;
+
+    /// The stopped_at field is when we stopped because the budget was over,
+    /// or zero if we drained everything during the previous wakeup.
+    uint64_t stopped_at = 0;
+};
+
+/// ## Budget
+///
+/// Budget is the work that we can still do during the current wakeup.
+///
+/// ### Fields
+class Budget {
+  public:
+    /// The max_events field is the maximum number of events to deliver, or
+    /// zero if unbounded.
+    uint64_t max_events = 0;
+
+    /// The deadline field is the uv_hrtime() after which we must stop, or
+    /// zero if unbounded.
+    uint64_t deadline = 0;
+
+    /// The events field is the number of events delivered so far.
+    uint64_t events = 0;
+
+    /// The exhausted() method tells whether the budget is over.
+    bool exhausted() const {
+        return (max_events != 0 && events >= max_events) ||
+               (deadline != 0 && uv_hrtime() >= deadline);
+    }
+};
+
+/// ## Dispatcher
+///
+/// Dispatcher is the owner of the `uv_async_t` handle through which all the
+/// Contexts of a loop wakeup such loop. There is one Dispatcher per loop, so
+/// that worker threads, each running its own loop, do not share state. Like
+/// Context, it is a class because it's not a piece of POD.
+///
+/// ### Fields
+class Dispatcher {
+  public:
+    /// The `async` structure is the only libuv handle used by the bridge on
+    /// this loop. We unref it when no channel is registered, so that it does
+    /// not prevent uv_loop() from exiting, and we close it only when the loop
+    /// itself is going away. We must init this field explicitly because it's
+    /// a piece of POD.
     uv_async_t async{};
 
-    /// The mutex structure is used to make this class thread safe.
-    std::recursive_mutex mutex;
+    /// The `timer` structure is used to resume when coalesced values held
+    /// back because of the coalescing interval are due, since producers do
+    /// not wakeup the loop when they overwrite such values. Like `async`, it
+    /// is unref'd and it is closed when the loop is going away.
+    uv_timer_t timer{};
+
+    /// The timer_due field is the uv_hrtime() at which `timer` expires, or
+    /// zero if it is not armed. Only libuv's thread can access it.
+    uint64_t timer_due = 0;
+
+    /// The send_mutex protects `closed` and prevents MK threads from calling
+    /// uv_async_send() while or after libuv's thread closes `async`.
+    std::mutex send_mutex;
+
+    /// The closed field tells whether `async` has been closed.
+    bool closed = false;
+
+    /// The wakeup_pending flag tells whether uv_async_send() was called and
+    /// mkuv_resume() has not started draining yet. In such case, there is no
+    /// need to call uv_async_send() again, which saves a syscall.
+    std::atomic<bool> wakeup_pending{false};
+
+    /// The retired field accumulates the counters of unregistered Contexts.
+    /// Only libuv's thread can access it.
+    Stats retired;
+
+    /// The channels field is the list of registered Contexts. It is only
+    /// accessed by libuv's thread, hence it does not need a lock.
+    std::list<SharedPtr<Context>> channels;
+
+    /// The policy field is the drain policy, which by default is to drain
+    /// everything at every wakeup. Only libuv's thread can access it.
+    DrainPolicy policy;
 
-    /// The suspended field is the list of suspended callbacks.
-    std::list<std::function<void()>> suspended;
+    /// The passes field counts the mkuv_resume() passes and max_pass_events
+    /// is the largest number of events delivered by one of them, summing
+    /// over all channels. Only libuv's thread can access them.
+    uint64_t passes = 0;
+    uint64_t max_pass_events = 0;
 };
 
-/// make<>() constructs an Context instance. This function shall throw if an
-/// unrecoverable error occurs, as we do in other places in MK.
-template <MK_MOCK(uv_async_init)> static SharedPtr<Context> make() {
-    SharedPtr<Context> ctx{new Context};
-    // We let the opaque libuv pointer point to a dynamically allocated
-    // shared pointer to the context to guarantee it'll be alive
-    ctx->async.data = new SharedPtr<Context>{ctx};
-    if (uv_async_init(uv_default_loop(), &ctx->async, mkuv_resume)) {
-        throw std::runtime_error("uv_async_init");
+/// ## Dispatchers
+///
+/// Dispatchers maps each loop to its Dispatcher.
+///
+/// ### Fields
+class Dispatchers {
+  public:
+    /// The mutex protects `by_loop`, since loops run in different threads.
+    std::mutex mutex;
+
+    /// The by_loop field maps a loop to its Dispatcher.
+    std::map<uv_loop_t *, SharedPtr<Dispatcher>> by_loop;
+};
+
+/// dispatchers() returns the process-wide Dispatchers. This is not `static`
+/// because we want a single instance for all translation units.
+inline Dispatchers &dispatchers() {
+    static Dispatchers instance;
+    return instance;
+}
+
+/// dispatcher<>() returns the Dispatcher of `loop`, creating it the first
+/// time. It must be called by the thread running `loop`. This function shall
+/// throw if an unrecoverable error occurs, as we do in other places in MK.
+/// In such case, the handles initialized so far are closed, and the loop is
+/// left without a Dispatcher, as if this function was never called.
+template <MK_MOCK(uv_async_init)>
+static SharedPtr<Dispatcher> dispatcher(uv_loop_t *loop) {
+    Dispatchers &all = dispatchers();
+    std::unique_lock<std::mutex> _{all.mutex};
+    SharedPtr<Dispatcher> &disp = all.by_loop[loop];
+    if (!disp) {
+        SharedPtr<Dispatcher> created{new Dispatcher};
+        created->timer.data = created.get();
+        if (uv_timer_init(loop, &created->timer)) {
+            all.by_loop.erase(loop);
+            throw std::runtime_error("uv_timer_init");
+        }
+        uv_unref((uv_handle_t *)&created->timer);
+        created->async.data = created.get();
+        if (uv_async_init(loop, &created->async, mkuv_resume)) {
+            // Note: libuv references the timer until it is closed, hence
+            // the Dispatcher must live until then (see mkuv_delete())
+            created->timer.data = new SharedPtr<Dispatcher>{created};
+            uv_close((uv_handle_t *)&created->timer, mkuv_delete);
+            all.by_loop.erase(loop);
+            throw std::runtime_error("uv_async_init");
+        }
+        uv_unref((uv_handle_t *)&created->async);
+        disp = created;
+    }
+    return disp;
+}
+
+/// make<>() constructs an Context instance and registers it with the
+/// Dispatcher of `loop`, creating the latter the first time. It must be
+/// called by the thread running `loop`.
+template <MK_MOCK(uv_async_init)>
+static SharedPtr<Context> make(uv_loop_t *loop = uv_default_loop()) {
+    SharedPtr<Dispatcher> disp = dispatcher<uv_async_init>(loop);
+    if (disp->channels.empty()) {
+        uv_ref((uv_handle_t *)&disp->async);
     }
+    SharedPtr<Context> ctx{new Context};
+    ctx->disp = disp;
+    ctx->self = disp->channels.insert(disp->channels.end(), ctx);
     return ctx;
 }
 
+/// unregister() removes `ctx` from the Dispatcher's channels and unrefs the
+/// Dispatcher's handle if no channel is left. It must be called by libuv's
+/// thread, after the last event suspended on `ctx`. We also run and clear the
+/// on_drained functions and clear `dispatch`, so that whatever they hold (e.g.
+/// JavaScript callbacks) is released here rather than in whatever thread
+/// happens to drop the last reference to `ctx`.
+static inline void unregister(const SharedPtr<Context> &ctx) {
+    Dispatcher &disp = *ctx->disp;
+    for (auto &f : ctx->on_drained) {
+        f();
+    }
+    ctx->on_drained.clear();
+    ctx->dispatch = nullptr;
+    accumulate(disp.retired, *ctx->stats);
+    disp.channels.erase(ctx->self);
+    if (disp.channels.empty()) {
+        uv_unref((uv_handle_t *)&disp.async);
+    }
+}
+
+/// discarded() tells whether an event of type `type` must be discarded
+/// because `ctx` has been stopped.
+static inline bool discarded(Context &ctx, EventType type) {
+    return type != EventType::closure && type != EventType::final &&
+           ctx.stopped->load(std::memory_order_relaxed);
+}
+
+/// slot_of() returns the Slot of `ctx` for events of type `type`, or nullptr
+/// if such events must not be coalesced.
+static inline Slot *slot_of(Context &ctx, EventType type) {
+    if (!ctx.coalesce) {
+        return nullptr;
+    }
+    switch (type) {
+    case EventType::progress:
+        return &ctx.latest[0];
+    case EventType::data_usage:
+        return &ctx.latest[1];
+    default:
+        return nullptr;
+    }
+}
+
+/// admit() tells whether an event of class `klass` may be suspended on
+/// `ctx` considering the configured limits. If so, the event is accounted as
+/// pending, otherwise it is accounted as dropped. Because we do not lock, we
+/// may slightly overshoot the limit when many threads are suspending.
+static inline bool admit(Context &ctx, EventClass klass) {
+    if (klass == EventClass::other) {
+        return true;
+    }
+    Limit &limit = ctx.limits->by_class[(int)klass];
+    if (limit.max == 0) {
+        return true;
+    }
+    if (limit.pending.load(std::memory_order_relaxed) >= limit.max) {
+        uint64_t n = limit.overflowed.fetch_add(1, std::memory_order_relaxed);
+        if (limit.sample_every == 0 || n % limit.sample_every != 0) {
+            limit.dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    limit.pending.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+/// resumed() accounts that an event of class `klass` is not pending anymore.
+static inline void resumed(Context &ctx, EventClass klass) {
+    if (klass != EventClass::other) {
+        Limit &limit = ctx.limits->by_class[(int)klass];
+        if (limit.max != 0) {
+            limit.pending.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+/// queue_of() returns the lock-free queue of `lane`, allocating it the first
+/// time. It is safe to call this function concurrently from many threads.
+static inline MpscQueue<Event> &queue_of(Lane &lane) {
+    MpscQueue<Event> *queue = lane.suspended.load(std::memory_order_acquire);
+    if (queue == nullptr) {
+        std::call_once(lane.allocated, [&lane]() {
+            lane.storage.reset(new MpscQueue<Event>{lane.capacity});
+            lane.suspended.store(lane.storage.get(), std::memory_order_release);
+        });
+        queue = lane.storage.get();
+    }
+    return *queue;
+}
+
+/// enqueue() adds an event to the ones suspended on `lane`, calling `fill` to
+/// write it in place. In the common case this is a single lock-free push. Only
+/// when the queue is full, or it has been full and libuv's thread did not
+/// catch up yet, we take a lock and append to the overflow list.
+template <typename Fill> static void enqueue(Lane &lane, Fill &&fill) {
+    if (!lane.overflowing.load(std::memory_order_acquire) &&
+            queue_of(lane).try_push_with(fill)) {
+        return;
+    }
+    std::unique_lock<std::mutex> _{lane.overflow_mutex};
+    lane.overflowing.store(true, std::memory_order_release);
+    lane.overflow.emplace_back();
+    fill(lane.overflow.back());
+}
+
+/// count() counts a new event suspended on a Context having `stats` and
+/// returns its sequence number. We count the event before queueing it, so
+/// that `resumed` never exceeds `events` as seen by this thread, and we use
+/// the difference between them as the queue depth, to update the high-water
+/// mark. The sequence number orders the event with respect to other lanes.
+static inline uint64_t count(Stats &stats) {
+    uint64_t events = stats.events.fetch_add(1, std::memory_order_relaxed) + 1;
+    uint64_t resumed = stats.resumed.load(std::memory_order_relaxed);
+    if (events > resumed) {
+        uint64_t depth = events - resumed;
+        uint64_t max = stats.max_depth.load(std::memory_order_relaxed);
+        while (depth > max && !stats.max_depth.compare_exchange_weak(
+                                      max, depth, std::memory_order_relaxed)) {
+            // Retry unless someone else recorded a higher depth
+        }
+    }
+    return events;
+}
+
+/// overwrite() writes an event of type `type` into `slot`, calling `fill` to
+/// write it in place, and returns true if `slot` was empty, hence the event
+/// must be counted and the loop must be woken up.
+template <typename Fill>
+static bool overwrite(Context &ctx, Slot &slot, EventType type, Fill &&fill) {
+    std::unique_lock<std::mutex> _{slot.mutex};
+    slot.latest.type = type;
+    fill(slot.latest);
+    if (slot.pending) {
+        ctx.stats->coalesced.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    slot.pending = true;
+    slot.latest.enqueued_at = uv_hrtime();
+    slot.latest.seq = count(*ctx.stats);
+    return true;
+}
+
+/// acquire() blocks the calling producer until the Gate `gate` has room for
+/// one more event, unless it is open.
+static inline void acquire(Gate &gate) {
+    std::unique_lock<std::mutex> lock{gate.mutex};
+    gate.space.wait(lock,
+            [&gate]() { return gate.open || gate.pending < gate.capacity; });
+    if (!gate.open) {
+        gate.pending += 1;
+    }
+}
+
+/// release() accounts that `count` events were drained from `gate`.
+static inline void release(Gate &gate, uint64_t count) {
+    {
+        std::unique_lock<std::mutex> _{gate.mutex};
+        gate.pending -= (std::min)(gate.pending, count);
+    }
+    gate.space.notify_all();
+}
+
+/// wakeup<>() wakes up the loop of `ctx`, unless a wakeup is already pending,
+/// or the thread blocked on the Gate of `ctx`, if any, unless it is open.
+template <MK_MOCK(uv_async_send)> static void wakeup(Context &ctx) {
+    if (ctx.gate) {
+        Gate &gate = *ctx.gate;
+        std::unique_lock<std::mutex> _{gate.mutex};
+        if (!gate.open) {
+            gate.woken = true;
+            gate.ready.notify_one();
+            return;
+        }
+    }
+    // Note: acq_rel pairs with the exchange in mkuv_resume(), such that, if
+    // we see a pending wakeup, the event we have just queued is visible to
+    // the drain that follows such wakeup.
+    if (ctx.disp->wakeup_pending.exchange(true, std::memory_order_acq_rel)) {
+        return;
+    }
+    ctx.stats->wakeups.fetch_add(1, std::memory_order_relaxed);
+    std::unique_lock<std::mutex> _{ctx.disp->send_mutex};
+    if (!ctx.disp->closed && uv_async_send(&ctx.disp->async) != 0) {
+        throw std::runtime_error("uv_async_send");
+    }
+}
+
+/// emit<>() suspends an event of type `type` in the context of an MK thread
+/// so that later it can be delivered in the context of libuv loop. As libuv
+/// may coalesce multiple uv_async_send() calls, we use a queue to keep track
+/// of all the events that need to be delivered. For the same reason, we do
+/// not call uv_async_send() if a wakeup is already pending, so a burst of
+/// events costs a single syscall. Of course, this method is
+/// thread safe, since multiple threads can operate on the queue. The `fill`
+/// function is called to write the event's arguments into the Event record.
+/// We take `ctx` by reference so we don't touch its reference count for
+/// every event. Events of a bounded class may be dropped, and events of a
+/// stopped Context are discarded.
+///
+/// Events that must be coalesced are written into their Slot instead, and
+/// we do not need to wakeup the loop when they replace an undelivered one.
+template <MK_MOCK(uv_async_send), typename Fill>
+static void emit(const SharedPtr<Context> &ctx, EventType type, Fill &&fill) {
+    if (discarded(*ctx, type)) {
+        return;
+    }
+    Slot *slot = slot_of(*ctx, type);
+    if (slot != nullptr) {
+        if (!overwrite(*ctx, *slot, type, fill)) {
+            return;
+        }
+    } else {
+        if (!admit(*ctx, class_of(type))) {
+            return;
+        }
+        if (ctx->gate) {
+            acquire(*ctx->gate);
+        }
+        uint64_t seq = count(*ctx->stats);
+        uint64_t now = uv_hrtime();
+        enqueue(ctx->lanes[(int)priority_of(type)], [&](Event &ev) {
+            ev.type = type;
+            ev.enqueued_at = now;
+            ev.seq = seq;
+            fill(ev);
+        });
+    }
+    wakeup<uv_async_send>(*ctx);
+}
+
 /// suspend<>() suspends the execution of `f` in the context of an MK thread
-/// so that later it can be resumed in the context of libuv loop. As libuv
-/// may coalesce multiple uv_async_send() calls, we use a list to keep track
-/// of all the callbacks that need to be resumed. Of course, this method is
-/// thread safe, since multiple threads can operate on the list. It is key
+/// so that later it can be resumed in the context of libuv loop. It is key
 /// to move `f` so to give libuv's thread unique ownership.
 template <MK_MOCK(uv_async_send)>
-static void suspend(SharedPtr<Context> ctx, std::function<void()> &&func) {
-    std::unique_lock<std::recursive_mutex> _{ctx->mutex};
-    ctx->suspended.push_back(std::move(func));
-    if (uv_async_send(&ctx->async) != 0) {
-        throw std::runtime_error("uv_async_send");
+static void suspend(
+        const SharedPtr<Context> &ctx, std::function<void()> &&func) {
+    emit<uv_async_send>(ctx, EventType::closure,
+            [&func](Event &ev) { ev.func = std::move(func); });
+}
+
+/// resume() delivers the event `ev` and charges it to `budget`. We also
+/// measure how long the event waited and how long delivering it took.
+static inline void resume(Context &ctx, Event &ev, Budget &budget) {
+    Stats &stats = *ctx.stats;
+    uint64_t started = uv_hrtime();
+    stats.latency.record(started - ev.enqueued_at);
+    // As said above, exception are fatal, so don't catch them
+    if (ev.type == EventType::closure) {
+        ev.func();
+        ev.func = nullptr;
+    } else if (!discarded(ctx, ev.type)) {
+        ctx.dispatch(ev);
+    }
+    stats.callback_ns += uv_hrtime() - started;
+    stats.resumed.fetch_add(1, std::memory_order_relaxed);
+    if (ev.payload.capacity() > max_retained_payload) {
+        std::string{}.swap(ev.payload);
+    }
+    if (!ev.tree.is_null()) {
+        ev.tree = nullptr;
+    }
+    budget.events += 1;
+}
+
+/// front() returns the oldest event suspended on `lane`, or nullptr. We look
+/// into the lock-free queue first, then into the overflow list, if producers
+/// have spilled into it. Events in the queue always come first, since they
+/// may have been queued before the spilled ones. We clear the overflowing
+/// flag only when the overflow list is found empty, so that from then on
+/// events go again into the lock-free queue. It must only be called by
+/// libuv's thread, and it returns the same event until pop() is called.
+static inline Event *front(Lane &lane) {
+    if (lane.head != nullptr) {
+        return lane.head;
+    }
+    MpscQueue<Event> *queue = lane.suspended.load(std::memory_order_acquire);
+    lane.head = (queue != nullptr) ? queue->peek() : nullptr;
+    if (lane.head != nullptr) {
+        lane.head_in_queue = true;
+        return lane.head;
+    }
+    if (lane.resuming.empty()) {
+        if (!lane.overflowing.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        std::unique_lock<std::mutex> _{lane.overflow_mutex};
+        if (lane.overflow.empty()) {
+            lane.overflowing.store(false, std::memory_order_release);
+            return nullptr;
+        }
+        std::swap(lane.overflow, lane.resuming);
+    }
+    lane.head = &lane.resuming.front();
+    lane.head_in_queue = false;
+    return lane.head;
+}
+
+/// pop() removes the event returned by front() from `lane`. Events in the
+/// lock-free queue stay there to be overwritten, so to reuse their buffers.
+static inline void pop(Lane &lane) {
+    if (lane.head_in_queue) {
+        lane.suspended.load(std::memory_order_relaxed)
+                ->try_consume([](Event &) {});
+    } else {
+        lane.resuming.pop_front();
+    }
+    lane.head = nullptr;
+}
+
+/// next() returns the lane of `ctx` containing the next event to deliver, or
+/// nullptr if there is none. That is the first event of the lane with the
+/// highest priority, unless it is a barrier, in which case we first deliver
+/// the events that it must not overtake, oldest first.
+static inline Lane *next(Context &ctx) {
+    Lane *chosen = nullptr;
+    for (Lane &lane : ctx.lanes) {
+        if (front(lane) != nullptr) {
+            chosen = &lane;
+            break;
+        }
+    }
+    while (chosen != nullptr) {
+        Event *ev = front(*chosen);
+        unsigned mask = barrier_of(ev->type);
+        Lane *earlier = nullptr;
+        uint64_t seq = ev->seq;
+        for (size_t i = 0; mask != 0 && i < lane_count; ++i) {
+            Event *other = nullptr;
+            if ((mask & (1 << i)) != 0 &&
+                    (other = front(ctx.lanes[i])) != nullptr &&
+                    other->seq < seq) {
+                earlier = &ctx.lanes[i];
+                seq = other->seq;
+            }
+        }
+        if (earlier == nullptr) {
+            break;
+        }
+        chosen = earlier;
+    }
+    return chosen;
+}
+
+/// deliver_latest() delivers the values in the slots of `ctx` that have not
+/// been delivered yet, unless the coalescing interval is not over, or `force`
+/// is true. Values held back are delivered during a later pass, and we set
+/// `held_until` to when the earliest of them is due, since producers do not
+/// wakeup the loop again until such values are delivered.
+static inline void deliver_latest(Context &ctx, Budget &budget, bool force) {
+    if (!ctx.coalesce) {
+        return;
+    }
+    uint64_t now = uv_hrtime();
+    ctx.held_until = 0;
+    for (Slot &slot : ctx.latest) {
+        {
+            std::unique_lock<std::mutex> _{slot.mutex};
+            if (!slot.pending) {
+                continue;
+            }
+            if (!force && now - slot.delivered_at < ctx.coalesce_interval_ns) {
+                uint64_t due = slot.delivered_at + ctx.coalesce_interval_ns;
+                if (ctx.held_until == 0 || due < ctx.held_until) {
+                    ctx.held_until = due;
+                }
+                continue;
+            }
+            std::swap(slot.latest, slot.delivering);
+            slot.pending = false;
+        }
+        slot.delivered_at = now;
+        resume(ctx, slot.delivering, budget);
+    }
+}
+
+/// drain_within() delivers the events suspended on `ctx`, within `budget`, and
+/// must only be called by libuv's thread. It returns whether all events
+/// have been delivered. We start from the latest values of coalesced events,
+/// then we deliver events in order of priority, taking barriers into account.
+/// Before a barrier, we also deliver the latest values held back because of
+/// the coalescing interval, so that, e.g., the last progress is delivered
+/// before the end of the test. Finally, we run the on_drained functions, also
+/// when the budget is over, so to deliver what we have accumulated.
+static inline bool drain_within(Context &ctx, Budget &budget) {
+    uint64_t before = budget.events;
+    uint64_t popped = 0;
+    bool complete = false;
+    deliver_latest(ctx, budget, false);
+    while (!budget.exhausted()) {
+        Lane *lane = next(ctx);
+        if (lane == nullptr) {
+            complete = true;
+            break;
+        }
+        Event &ev = *front(*lane);
+        if (barrier_of(ev.type) != 0) {
+            deliver_latest(ctx, budget, true);
+        }
+        resumed(ctx, class_of(ev.type));
+        resume(ctx, ev, budget);
+        pop(*lane);
+        popped += 1;
+    }
+    if (ctx.gate && popped > 0) {
+        release(*ctx.gate, popped);
+    }
+    for (auto &f : ctx.on_drained) {
+        f();
+    }
+    if (budget.events > before) {
+        Stats &stats = *ctx.stats;
+        stats.passes += 1;
+        stats.max_pass_events =
+                (std::max)(stats.max_pass_events, budget.events - before);
+    }
+    return complete;
+}
+
+/// drain() delivers all the events suspended on `ctx` and must only be called
+/// by libuv's thread.
+static inline void drain(Context &ctx) {
+    Budget unbounded;
+    drain_within(ctx, unbounded);
+}
+
+/// finish() tells the thread blocked on `gate` that the test is over. It must
+/// be called after the last event of the test has been suspended.
+static inline void finish(Gate &gate) {
+    std::unique_lock<std::mutex> _{gate.mutex};
+    gate.finished = true;
+    gate.ready.notify_one();
+}
+
+/// drain_until_finished<>() must be called by libuv's thread, which blocks
+/// until finish() is called on the Gate of `ctx`, delivering the events of
+/// `ctx` as they are suspended, and the coalesced values held back when they
+/// are due. Then, it opens the Gate. Since an event may
+/// have been suspended just before the Gate was open (e.g. the closure that
+/// unregisters `ctx`), we also wakeup the loop, which will deliver it.
+template <MK_MOCK(uv_async_send)>
+static void drain_until_finished(const SharedPtr<Context> &ctx) {
+    Gate &gate = *ctx->gate;
+    for (;;) {
+        bool finished = false;
+        {
+            std::unique_lock<std::mutex> lock{gate.mutex};
+            auto ready = [&gate]() { return gate.woken || gate.finished; };
+            if (ctx->held_until == 0) {
+                gate.ready.wait(lock, ready);
+            } else {
+                uint64_t now = uv_hrtime();
+                uint64_t due = (std::max)(ctx->held_until, now);
+                gate.ready.wait_for(
+                        lock, std::chrono::nanoseconds(due - now), ready);
+            }
+            gate.woken = false;
+            finished = gate.finished;
+        }
+        drain(*ctx);
+        if (finished) {
+            break;
+        }
+    }
+    {
+        std::unique_lock<std::mutex> _{gate.mutex};
+        gate.open = true;
+    }
+    gate.space.notify_all();
+    wakeup<uv_async_send>(*ctx);
+}
+
+/// end_pass() accounts the events delivered by a pass of `disp`.
+static inline void end_pass(Dispatcher &disp, const Budget &budget) {
+    disp.passes += 1;
+    disp.max_pass_events = (std::max)(disp.max_pass_events, budget.events);
+}
+
+/// start_pass() returns the budget for the current wakeup according to
+/// `policy`, adapting the time slice to the lag if needed.
+static inline Budget start_pass(DrainPolicy &policy) {
+    Budget budget;
+    budget.max_events = policy.max_events;
+    if (policy.max_time_ns != 0) {
+        uint64_t now = uv_hrtime();
+        uint64_t slice = policy.max_time_ns;
+        if (policy.adaptive && policy.stopped_at != 0) {
+            uint64_t lag = now - policy.stopped_at;
+            if (lag > policy.slice_ns) {
+                slice = (std::max)(policy.slice_ns / 2, slice / 16);
+            } else {
+                slice = (std::min)(policy.slice_ns * 2, slice);
+            }
+        }
+        policy.slice_ns = slice;
+        budget.deadline = now + slice;
+    }
+    return budget;
+}
+
+/// arm() arms the timer of `disp`, unless it is already armed to expire
+/// earlier, such that mkuv_expire() resumes when the earliest coalesced value
+/// held back by the channels of `disp` is due. It must only be called by
+/// libuv's thread, at the end of a pass.
+static inline void arm(Dispatcher &disp) {
+    uint64_t due = 0;
+    for (auto &ctx : disp.channels) {
+        if (ctx->held_until != 0 && (due == 0 || ctx->held_until < due)) {
+            due = ctx->held_until;
+        }
+    }
+    if (due == 0 || (disp.timer_due != 0 && disp.timer_due <= due)) {
+        return;
+    }
+    uint64_t now = uv_hrtime();
+    uint64_t ms = (due > now) ? (due - now + 999999) / 1000000 : 0;
+    disp.timer_due = due;
+    if (uv_timer_start(&disp.timer, mkuv_expire, ms, 0) != 0) {
+        throw std::runtime_error("uv_timer_start");
     }
 }
 
 /// start_delete() initiates a delete operation of an Context. We need to
-/// suspend() because we have experimentally noticed that on Linux it will
-/// not work if we call uv_close() from a non-libuv thread.
+/// suspend() because the Dispatcher's channels, as well as the reference
+/// count of its handle, can only be touched by libuv's thread.
 ///
-/// We cannot delete the context right away because we must need to wait
-/// for libuv to finish using it, which happens when mkuv_delete is called.
+/// We cannot delete the context right away because events suspended
+/// before this one must still run. The Context will be deleted when the
+/// last copy of the shared pointer goes out of scope.
 static void start_delete(SharedPtr<Context> ctx) {
-    suspend(ctx,
-            [ctx]() { uv_close((uv_handle_t *)&ctx->async, mkuv_delete); });
+    suspend(ctx, [ctx]() { unregister(ctx); });
+}
+
+/// close<>() closes the Dispatcher of `loop`, if any, and must be called by
+/// the thread running `loop` before it is closed. We release what the channels
+/// hold (e.g. JavaScript callbacks) and forget about them, but we do not run
+/// their on_drained functions, because the loop is going away. The Dispatcher
+/// is deleted when its handles are closed and no Context references it anymore.
+/// We leave `wakeup_pending` set, so that MK threads still running tests do not
+/// even try to wakeup the loop.
+template <MK_MOCK(uv_close)> static void close(uv_loop_t *loop) {
+    SharedPtr<Dispatcher> disp;
+    {
+        Dispatchers &all = dispatchers();
+        std::unique_lock<std::mutex> _{all.mutex};
+        auto it = all.by_loop.find(loop);
+        if (it == all.by_loop.end()) {
+            return;
+        }
+        disp = it->second;
+        all.by_loop.erase(it);
+    }
+    {
+        std::unique_lock<std::mutex> _{disp->send_mutex};
+        disp->closed = true;
+        disp->wakeup_pending.store(true, std::memory_order_release);
+    }
+    for (auto &ctx : disp->channels) {
+        ctx->on_drained.clear();
+        ctx->dispatch = nullptr;
+    }
+    disp->channels.clear();
+    disp->async.data = new SharedPtr<Dispatcher>{disp};
+    uv_close((uv_handle_t *)&disp->async, mkuv_delete);
+    disp->timer.data = new SharedPtr<Dispatcher>{disp};
+    uv_close((uv_handle_t *)&disp->timer, mkuv_delete);
 }
 
 } // namespace async
@@ -162,33 +1336,61 @@ static void start_delete(SharedPtr<Context> ctx) {
 /// execution of the suspended callbacks.
 ///
 /// The `handle` pointer used by libuv needs to be converted into an instance of
-/// the Context class. This function is also thread safe, since it needs to
-/// extract from the list shared with MK threads. Also for thread safety we use
-/// move semantic to remove from the list. (As in many other parts of MK, we
-/// treat exceptions as fatal errors and we do not filter them.)
+/// the Dispatcher class. Then we drain the suspended events of every
+/// channel, which in the common case does not require any lock since we are
+/// the only consumer of the queues shared with MK threads. (As in many other
+/// parts of MK, we treat exceptions as fatal errors and we do not filter them.)
 static inline void mkuv_resume(uv_async_t *handle) {
     using namespace mk::node::async;
     using namespace mk;
-    auto pctx = static_cast<SharedPtr<Context> *>(handle->data);
-    SharedPtr<Context> ctx{*pctx}; // Until end of scope, keep it safe
-    std::list<std::function<void()>> functions;
-    {
-        std::unique_lock<std::recursive_mutex> _{ctx->mutex};
-        std::swap(ctx->suspended, functions);
-    }
-    for (auto &fn : functions) {
-        fn(); // As said above, exception are fatal, so don't catch them
+    auto disp = static_cast<Dispatcher *>(handle->data);
+    // Clear the flag before draining: events queued from now on may not be
+    // seen by this pass, hence their producers must wakeup the loop again.
+    disp->wakeup_pending.exchange(false, std::memory_order_acq_rel);
+    Budget budget = start_pass(disp->policy);
+    for (auto it = disp->channels.begin(); it != disp->channels.end();) {
+        // Note: advance before draining because draining may unregister
+        // the channel, thus invalidating the iterator pointing to it
+        SharedPtr<Context> ctx{*it++}; // Until end of scope, keep it safe
+        if (!drain_within(*ctx, budget)) {
+            // The budget is over. Rotate the channels such that the next
+            // wakeup starts from the ones we did not visit, and wakeup the
+            // loop again, so that it can serve other I/O meanwhile.
+            disp->channels.splice(disp->channels.end(), disp->channels,
+                    disp->channels.begin(), it);
+            end_pass(*disp, budget);
+            disp->policy.stopped_at = uv_hrtime();
+            disp->wakeup_pending.store(true, std::memory_order_release);
+            if (uv_async_send(handle) != 0) {
+                throw std::runtime_error("uv_async_send");
+            }
+            return;
+        }
     }
+    end_pass(*disp, budget);
+    disp->policy.stopped_at = 0;
+    arm(*disp);
+}
+
+/// The mkuv_expire() C callback is called by libuv's I/O loop thread when the
+/// timer of a Dispatcher expires, meaning that coalesced values held back
+/// because of the coalescing interval are due. We deliver them, along with
+/// any other pending event, with a regular pass.
+static inline void mkuv_expire(uv_timer_t *handle) {
+    using namespace mk::node::async;
+    using namespace mk;
+    auto disp = static_cast<Dispatcher *>(handle->data);
+    disp->timer_due = 0;
+    mkuv_resume(&disp->async);
 }
 
-/// The mkuv_delete() C callback is called by libuv's I/O loop thread when
-/// libuv has successfully closed the async handle, to tell us that now it's
-/// safe to dispose of the memory associated with such handle.
+/// The mkuv_delete() C callback is called by libuv's I/O loop thread when a
+/// handle of a Dispatcher has been closed. It releases the reference that was
+/// keeping the Dispatcher alive while closing such handle.
 static inline void mkuv_delete(uv_handle_t *handle) {
     using namespace mk::node::async;
     using namespace mk;
-    uv_async_t *async_handle = reinterpret_cast<uv_async_t *>(handle);
-    delete static_cast<SharedPtr<Context> *>(async_handle->data);
+    delete static_cast<SharedPtr<Dispatcher> *>(handle->data);
 }
 
 #endif
@@ -0,0 +1,134 @@
+// Part of measurement-kit <https://measurement-kit.github.io/>.
+// Measurement-kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef PRIVATE_NODE_METRICS_HPP
+#define PRIVATE_NODE_METRICS_HPP
+
+#include "private/node/async.hpp"
+#include <cstdint>
+#include <mutex>
+#include <sys/resource.h>
+#include <vector>
+
+namespace mk {
+namespace node {
+
+/// The thread_cpu_ns() function returns the CPU time, user plus system, used
+/// so far by the calling thread, or zero where per-thread usage is not
+/// available.
+static inline uint64_t thread_cpu_ns() {
+#ifdef RUSAGE_THREAD
+    struct rusage usage {};
+    if (getrusage(RUSAGE_THREAD, &usage) != 0) {
+        return 0;
+    }
+    return ((uint64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+                   1000000000 +
+           ((uint64_t)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+#else
+    return 0;
+#endif
+}
+
+/// # Metrics
+///
+/// Metrics records the timing and resource usage of a test run. Times are
+/// taken with uv_hrtime(), in nanoseconds, and zero means not happened yet.
+///
+/// The CPU time is the difference between the per-thread CPU time sampled by
+/// the MK callbacks of the run (begin, entries and end), which all run in
+/// MK's background thread. Hence it does not account for the work done by
+/// MK before the test begins, and it includes the work done by other tests
+/// running in the same thread meanwhile, if any.
+///
+/// ### Fields
+class Metrics {
+  public:
+    /// The event_type_count constant is the number of event types.
+    static constexpr size_t event_type_count =
+            (size_t)async::EventType::final + 1;
+
+    /// The mutex protects the fields written by MK's thread, i.e. all the
+    /// fields except `delivered` and `delivered_bytes`.
+    std::mutex mutex;
+
+    /// The started_ns field is when run() or start() was called.
+    uint64_t started_ns = 0;
+
+    /// The begun_ns field is when MK called on_begin.
+    uint64_t begun_ns = 0;
+
+    /// The entries field counts the entries of the test.
+    uint64_t entries = 0;
+
+    /// The last_entry_ns field is when MK called on_entry the last time.
+    uint64_t last_entry_ns = 0;
+
+    /// The entry_gaps_ns field contains, for each entry, the time elapsed
+    /// since the previous entry, or since on_begin for the first one.
+    std::vector<uint64_t> entry_gaps_ns;
+
+    /// The finished_ns field is when the test was over, i.e. when the final
+    /// callback was called or when run() returned.
+    uint64_t finished_ns = 0;
+
+    /// The first_cpu_ns and last_cpu_ns fields are the first and the last
+    /// CPU time of MK's thread sampled by the callbacks.
+    uint64_t first_cpu_ns = 0;
+    uint64_t last_cpu_ns = 0;
+
+    /// The delivered field counts the events delivered to JavaScript, by
+    /// type. It is only accessed by libuv's thread.
+    uint64_t delivered[event_type_count] = {};
+
+    /// The delivered_bytes field counts the bytes of the payloads of the
+    /// events delivered to JavaScript, by type. It is only accessed by
+    /// libuv's thread.
+    uint64_t delivered_bytes[event_type_count] = {};
+
+    /// The begin() method must be called by MK's on_begin callback.
+    void begin() {
+        uint64_t now = uv_hrtime();
+        std::unique_lock<std::mutex> _{mutex};
+        begun_ns = last_entry_ns = now;
+        sample_cpu();
+    }
+
+    /// The entry() method must be called by MK's on_entry callback.
+    void entry() {
+        uint64_t now = uv_hrtime();
+        std::unique_lock<std::mutex> _{mutex};
+        entries += 1;
+        if (last_entry_ns != 0) {
+            entry_gaps_ns.push_back(now - last_entry_ns);
+        }
+        last_entry_ns = now;
+        sample_cpu();
+    }
+
+    /// The end() method must be called by MK's on_end callback.
+    void end() {
+        std::unique_lock<std::mutex> _{mutex};
+        sample_cpu();
+    }
+
+    /// The finish() method records that the test is over.
+    void finish() {
+        uint64_t now = uv_hrtime();
+        std::unique_lock<std::mutex> _{mutex};
+        finished_ns = now;
+    }
+
+  private:
+    // Samples the CPU time of the calling thread.
+    void sample_cpu() {
+        last_cpu_ns = thread_cpu_ns();
+        if (first_cpu_ns == 0) {
+            first_cpu_ns = last_cpu_ns;
+        }
+    }
+};
+
+} // namespace node
+} // namespace mk
+#endif
@@ -0,0 +1,548 @@
+// Part of measurement-kit <https://measurement-kit.github.io/>.
+// Measurement-kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef PRIVATE_NODE_NETTEST_BATCH_HPP
+#define PRIVATE_NODE_NETTEST_BATCH_HPP
+
+#include "private/node/nettest_wrap.hpp"
+#include <functional>
+#include <map>
+#include <mutex>
+#include <nan.h>
+#include <string>
+#include <vector>
+
+namespace mk {
+namespace node {
+
+/// # Factories
+///
+/// Factories maps the name of each test (e.g. "NdtTest") to a function that
+/// creates such test, so that tests can be created by name.
+///
+/// ### Fields
+class Factories {
+  public:
+    /// The mutex protects `by_name`, since worker threads may register
+    /// tests while other threads are creating them.
+    std::mutex mutex;
+
+    /// The by_name field maps the name of a test to its factory.
+    std::map<std::string, std::function<SharedPtr<nettests::BaseTest>()>>
+            by_name;
+};
+
+/// factories() returns the process-wide Factories. This is not `static`
+/// because we want a single instance for all translation units.
+inline Factories &factories() {
+    static Factories instance;
+    return instance;
+}
+
+/// register_factory<>() registers the factory of `Nettest` as `name`.
+template <typename Nettest> static void register_factory(const char *name) {
+    Factories &all = factories();
+    std::unique_lock<std::mutex> _{all.mutex};
+    all.by_name[name] = []() {
+        return SharedPtr<nettests::BaseTest>{new Nettest};
+    };
+}
+
+/// make_test() returns a new test named `name`, or null if no such test has
+/// been registered.
+static inline SharedPtr<nettests::BaseTest> make_test(const std::string &name) {
+    Factories &all = factories();
+    std::unique_lock<std::mutex> _{all.mutex};
+    auto it = all.by_name.find(name);
+    if (it == all.by_name.end()) {
+        return {};
+    }
+    return it->second();
+}
+
+/// # BatchItem
+///
+/// BatchItem is a test of a NettestBatch. It is only accessed by libuv's
+/// thread, except for `metrics`, which is also written by MK's thread.
+///
+/// ### Fields
+class BatchItem {
+  public:
+    /// The tag field is the index of this test in the batch, which is passed
+    /// to callbacks to tell which test an event belongs to.
+    uint32_t tag = 0;
+
+    /// The name field is the name of the test.
+    std::string name;
+
+    /// The test field is the test, configured when added to the batch, and
+    /// released when it is over.
+    SharedPtr<nettests::BaseTest> test;
+
+    /// The metrics field records the timing of the test.
+    SharedPtr<Metrics> metrics{new Metrics};
+
+    /// The down and up fields are the bytes received and sent by the test.
+    double down = 0.0;
+    double up = 0.0;
+};
+
+/// # BatchHandlers
+///
+/// BatchHandlers contains the JavaScript callbacks to which the events of
+/// the tests of a batch are delivered, along with the tag of the test. It is
+/// only accessed by libuv's thread.
+class BatchHandlers {
+  public:
+    /// The following fields are the callbacks for each type of event. Each
+    /// of them is null until the corresponding callback setter is called.
+    SharedPtr<Nan::Callback> begin;
+    SharedPtr<Nan::Callback> end;
+    SharedPtr<Nan::Callback> entry;
+    SharedPtr<Nan::Callback> event;
+    SharedPtr<Nan::Callback> log;
+    SharedPtr<Nan::Callback> progress;
+    SharedPtr<Nan::Callback> final;
+};
+
+/// # Batch
+///
+/// Batch is the state of a NettestBatch, which is shared with the async
+/// Contexts of the running tests, such that the batch keeps running even
+/// if the JavaScript object is garbage collected. It is only accessed by
+/// libuv's thread.
+///
+/// ### Fields
+class Batch {
+  public:
+    /// The items field contains the tests of the batch.
+    std::vector<SharedPtr<BatchItem>> items;
+
+    /// The concurrency field is the maximum number of tests running at the
+    /// same time.
+    uint32_t concurrency = 1;
+
+    /// The verbosity field is the verbosity of all the tests.
+    uint32_t verbosity = MK_LOG_WARNING;
+
+    /// The started field tells whether the batch was started.
+    bool started = false;
+
+    /// The next field is the index of the next test to start.
+    size_t next = 0;
+
+    /// The running field is the number of tests running.
+    size_t running = 0;
+
+    /// The finished field is the number of tests that are over and whose
+    /// events have all been delivered.
+    size_t finished = 0;
+
+    /// The handlers field contains the JavaScript callbacks.
+    BatchHandlers handlers;
+};
+
+/// The results_array() function returns the results of the tests of `batch`
+/// as an array with, for each test, an object containing its `tag`, its
+/// `name`, the number of `entries`, the `wallTimeMs` and `cpuTimeMs` (see
+/// Metrics) and the `dataUsage`. The caller must have opened a handle scope.
+static inline v8::Local<v8::Array> results_array(const Batch &batch) {
+    v8::Local<v8::Array> results = Nan::New<v8::Array>((int)batch.items.size());
+    for (size_t i = 0; i < batch.items.size(); ++i) {
+        BatchItem &item = *batch.items[i];
+        Metrics &metrics = *item.metrics;
+        v8::Local<v8::Object> result = Nan::New<v8::Object>();
+        auto set = [&result](const char *name, v8::Local<v8::Value> value) {
+            Nan::Set(result, Nan::New(name).ToLocalChecked(), value);
+        };
+        set("tag", Nan::New(item.tag));
+        set("name", Nan::New(item.name).ToLocalChecked());
+        {
+            std::unique_lock<std::mutex> _{metrics.mutex};
+            set("entries", Nan::New((double)metrics.entries));
+            set("wallTimeMs",
+                    Nan::New((double)(metrics.finished_ns -
+                                      metrics.started_ns) / 1e06));
+            set("cpuTimeMs",
+                    Nan::New((double)(metrics.last_cpu_ns -
+                                      metrics.first_cpu_ns) / 1e06));
+        }
+        v8::Local<v8::Object> usage = Nan::New<v8::Object>();
+        Nan::Set(usage, Nan::New("down").ToLocalChecked(), Nan::New(item.down));
+        Nan::Set(usage, Nan::New("up").ToLocalChecked(), Nan::New(item.up));
+        set("dataUsage", usage);
+        Nan::Set(results, (uint32_t)i, result);
+    }
+    return results;
+}
+
+static inline void launch(const SharedPtr<Batch> &batch);
+
+/// The dispatch_tagged() function delivers the event `ev` of `item` to the
+/// callbacks of `batch`, in the context of libuv's loop. When the test is
+/// over, we start the next one, if any (see also retire()).
+static inline void dispatch_tagged(
+        const SharedPtr<Batch> &batch, BatchItem &item, async::Event &ev) {
+    Nan::HandleScope scope;
+    BatchHandlers &handlers = batch->handlers;
+    v8::Local<v8::Value> tag = Nan::New(item.tag);
+    switch (ev.type) {
+    case async::EventType::begin: {
+        v8::Local<v8::Value> argv[] = {tag};
+        call(handlers.begin, 1, argv);
+        break;
+    }
+    case async::EventType::end: {
+        v8::Local<v8::Value> argv[] = {tag};
+        call(handlers.end, 1, argv);
+        break;
+    }
+    case async::EventType::entry: {
+        v8::Local<v8::Value> argv[] = {
+                tag, Nan::New(ev.payload).ToLocalChecked()};
+        call(handlers.entry, 2, argv);
+        break;
+    }
+    case async::EventType::event: {
+        v8::Local<v8::Value> argv[] = {
+                tag, Nan::New(ev.payload).ToLocalChecked()};
+        call(handlers.event, 2, argv);
+        break;
+    }
+    case async::EventType::log: {
+        v8::Local<v8::Value> argv[] = {tag, Nan::New(ev.level),
+                Nan::New(ev.payload).ToLocalChecked()};
+        call(handlers.log, 3, argv);
+        break;
+    }
+    case async::EventType::progress: {
+        v8::Local<v8::Value> argv[] = {tag, Nan::New(ev.values[0]),
+                Nan::New(ev.payload).ToLocalChecked()};
+        call(handlers.progress, 3, argv);
+        break;
+    }
+    case async::EventType::data_usage:
+        item.down = ev.values[0];
+        item.up = ev.values[1];
+        break;
+    case async::EventType::final:
+        item.metrics->finish();
+        item.test.reset();
+        batch->running -= 1;
+        launch(batch);
+        break;
+    case async::EventType::closure:
+        break; // Closures are run by the async bridge itself
+    }
+}
+
+/// The retire() function unregisters the async Context `ctx` of a test of
+/// `batch` and, if that was the last test, calls the final callback. It is
+/// suspended when the test is destroyed, and closures are delivered after
+/// all the events suspended before them, hence the results only include
+/// data usage and metrics that have already been delivered.
+static inline void retire(
+        const SharedPtr<Batch> &batch, const SharedPtr<async::Context> &ctx) {
+    async::unregister(ctx);
+    batch->finished += 1;
+    if (batch->finished < batch->items.size() || !batch->handlers.final) {
+        return;
+    }
+    Nan::HandleScope scope;
+    v8::Local<v8::Value> argv[] = {results_array(*batch)};
+    call(batch->handlers.final, 1, argv);
+}
+
+/// The start_item() function starts the test `item` of `batch`. Each test
+/// has its own async Context, so that it is unregistered when the test is
+/// destroyed, but all Contexts share the Dispatcher of the loop, hence a
+/// single libuv handle and drain budget. Events are only suspended if the
+/// corresponding callback is set, while log lines are swallowed rather than
+/// written on the standard error when on_log is not set.
+static inline void start_item(
+        const SharedPtr<Batch> &batch, const SharedPtr<BatchItem> &item) {
+    SharedPtr<async::Context> ctx = async::make<>(Nan::GetCurrentEventLoop());
+    ctx->dispatch = [batch, item](async::Event &ev) {
+        dispatch_tagged(batch, *item, ev);
+    };
+    BatchHandlers &handlers = batch->handlers;
+    SharedPtr<Metrics> metrics = item->metrics;
+    {
+        std::unique_lock<std::mutex> _{metrics->mutex};
+        metrics->started_ns = uv_hrtime();
+    }
+    nettests::BaseTest &test = *item->test;
+    test.set_verbosity(batch->verbosity);
+    install_begin_end(test, ctx, metrics, !!handlers.begin, !!handlers.end);
+    install_entry(test, ctx, metrics, {}, !!handlers.entry, false);
+    install_event(test, ctx, {}, !!handlers.event);
+    install_log(test, ctx, {}, !!handlers.log, MK_LOG_VERBOSITY_MASK);
+    if (handlers.progress) {
+        install_progress(test, ctx);
+    }
+    install_data_usage(test, ctx);
+    test.on_destroy([batch, ctx]() {
+        async::suspend<>(ctx, [batch, ctx]() { retire(batch, ctx); });
+    });
+    batch->running += 1;
+    test.start([ctx]() {
+        async::emit<>(ctx, async::EventType::final, [](async::Event &) {});
+    });
+}
+
+/// The launch() function starts tests of `batch` until either the limit on
+/// concurrency is reached or there are no more tests to start.
+static inline void launch(const SharedPtr<Batch> &batch) {
+    while (batch->running < batch->concurrency &&
+            batch->next < batch->items.size()) {
+        start_item(batch, batch->items[batch->next++]);
+    }
+}
+
+/// # NettestBatch
+///
+/// The NettestBatch class is the Node-visible object running many tests,
+/// possibly of different kinds, with a limit on how many of them may run at
+/// the same time. Tests are created by name using the factories registered
+/// by the module initialization (see REGISTER_TEST). Since all the tests of
+/// the batch run through the same Dispatcher, the number of tests running
+/// at once bounds both the work of MK and the events pending in the bridge.
+class NettestBatch : public Nan::ObjectWrap {
+  public:
+    /// ## Constructors
+
+    /// The static constructor() factory returns the Node constructor of this
+    /// class for the current isolate (see NettestWrap::constructor()).
+    static Nan::Persistent<v8::Function> &constructor() {
+        return constructors().current();
+    }
+
+    /// The static constructors() factory returns the constructors of this
+    /// class for all the isolates.
+    static Constructors &constructors() {
+        static Constructors instance;
+        return instance;
+    }
+
+    /// The static cleanup() method forgets about the constructor of
+    /// `isolate` when its environment is torn down.
+    static void cleanup(void *isolate) {
+        constructors().forget(static_cast<v8::Isolate *>(isolate));
+    }
+
+    /// The initialize() static method stores the constructor of this class
+    /// into the exports object as `NettestBatch`.
+    static void initialize(v8::Local<v8::Object> exports) {
+        Nan::HandleScope scope;
+        v8::Local<v8::String> name = Nan::New("NettestBatch").ToLocalChecked();
+        auto tpl = Nan::New<v8::FunctionTemplate>(make);
+        tpl->SetClassName(name);
+        tpl->InstanceTemplate()->SetInternalFieldCount(1);
+        Nan::SetPrototypeMethod(tpl, "add", add);
+        Nan::SetPrototypeMethod(tpl, "set_concurrency", set_concurrency);
+        Nan::SetPrototypeMethod(tpl, "set_verbosity", set_verbosity);
+        Nan::SetPrototypeMethod(tpl, "on_begin", on_begin);
+        Nan::SetPrototypeMethod(tpl, "on_end", on_end);
+        Nan::SetPrototypeMethod(tpl, "on_entry", on_entry);
+        Nan::SetPrototypeMethod(tpl, "on_event", on_event);
+        Nan::SetPrototypeMethod(tpl, "on_log", on_log);
+        Nan::SetPrototypeMethod(tpl, "on_progress", on_progress);
+        Nan::SetPrototypeMethod(tpl, "start", start);
+        exports->Set(name, tpl->GetFunction());
+        constructors().store(tpl->GetFunction(), cleanup);
+    }
+
+    /// The make() static method is the JavaScript object "constructor",
+    /// which works both with and without `new`.
+    static void make(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        if (info.Length() != 0) {
+            Nan::ThrowError("invalid number of arguments");
+            return;
+        }
+        if (!info.IsConstructCall()) {
+            Nan::HandleScope scope;
+            v8::Local<v8::Function> tpl = Nan::New<v8::Function>(constructor());
+            info.GetReturnValue().Set(
+                    tpl->NewInstance(info.GetIsolate()->GetCurrentContext(), 0,
+                               nullptr)
+                            .ToLocalChecked());
+            return;
+        }
+        NettestBatch *nb = new NettestBatch{};
+        nb->Wrap(info.This());
+        info.GetReturnValue().Set(info.This());
+    }
+
+    /// ## Setters
+
+    /// The add method adds a test to the batch. The arguments are the name
+    /// of the test (e.g. "NdtTest"), an object with the options of the test
+    /// (as in set_options_object) and an array with its inputs, which may be
+    /// empty. Like add_inputs, it returns an object telling how many inputs
+    /// were `added` and how many were `invalid`, which also contains the
+    /// `tag` of the test.
+    static void add(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        Nan::HandleScope scope;
+        if (info.Length() != 3 || !info[1]->IsObject() ||
+                !info[2]->IsArray()) {
+            Nan::ThrowError("invalid arguments");
+            return;
+        }
+        Batch &batch = *get_this(info)->batch;
+        if (batch.started) {
+            Nan::ThrowError("batch already started");
+            return;
+        }
+        SharedPtr<BatchItem> item{new BatchItem};
+        item->name = *v8::String::Utf8Value{info[0]->ToString()};
+        item->test = make_test(item->name);
+        if (!item->test) {
+            Nan::ThrowError("unknown test");
+            return;
+        }
+        apply_options(*item->test, info[1].As<v8::Object>());
+        v8::Local<v8::Array> array = info[2].As<v8::Array>();
+        Inputs inputs;
+        for (uint32_t i = 0; i < array->Length(); ++i) {
+            Nan::HandleScope element_scope;
+            v8::Local<v8::Value> value = Nan::Get(array, i).ToLocalChecked();
+            if (!value->IsString()) {
+                inputs.invalid += 1;
+                continue;
+            }
+            v8::String::Utf8Value s{value->ToString()};
+            inputs.add(*item->test, *s, *s + s.length());
+        }
+        item->tag = (uint32_t)batch.items.size();
+        batch.items.push_back(item);
+        v8::Local<v8::Object> result = inputs.to_object();
+        Nan::Set(result, Nan::New("tag").ToLocalChecked(), Nan::New(item->tag));
+        info.GetReturnValue().Set(result);
+    }
+
+    /// The set_concurrency setter sets the maximum number of tests running
+    /// at the same time, which is one by default.
+    static void set_concurrency(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(1, info, [&info](Batch &batch) {
+            batch.concurrency = (std::max)(info[0]->Uint32Value(), 1u);
+        });
+    }
+
+    /// The set_verbosity setter sets the logging verbosity of all the tests
+    /// (see NettestWrap::set_verbosity()).
+    static void set_verbosity(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(1, info, [&info](Batch &batch) {
+            batch.verbosity = info[0]->Uint32Value();
+        });
+    }
+
+    /// ## Callback Setters
+
+    /// The on_begin setter sets the callback called with the tag of a test
+    /// when it begins.
+    static void on_begin(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(1, info, [&info](Batch &batch) {
+            batch.handlers.begin = wrap_callback(info[0]);
+        });
+    }
+
+    /// The on_end setter sets the callback called with the tag of a test
+    /// after all its measurements have been performed.
+    static void on_end(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(1, info, [&info](Batch &batch) {
+            batch.handlers.end = wrap_callback(info[0]);
+        });
+    }
+
+    /// The on_entry setter sets the callback called with the tag of a test
+    /// and a serialized JSON after each measurement.
+    static void on_entry(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(1, info, [&info](Batch &batch) {
+            batch.handlers.entry = wrap_callback(info[0]);
+        });
+    }
+
+    /// The on_event setter sets the callback called with the tag of a test
+    /// and a serialized JSON for each test-specific event.
+    static void on_event(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(1, info, [&info](Batch &batch) {
+            batch.handlers.event = wrap_callback(info[0]);
+        });
+    }
+
+    /// The on_log setter sets the callback called with the tag of a test,
+    /// the level and the message of each log line. Not setting it means that
+    /// log lines are discarded.
+    static void on_log(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(1, info, [&info](Batch &batch) {
+            batch.handlers.log = wrap_callback(info[0]);
+        });
+    }
+
+    /// The on_progress setter sets the callback called with the tag of a
+    /// test, the percentage and a message to tell about its progress.
+    static void on_progress(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(1, info, [&info](Batch &batch) {
+            batch.handlers.progress = wrap_callback(info[0]);
+        });
+    }
+
+    /// ## runners
+
+    /// The start method starts the tests and calls the callback passed as
+    /// argument, with the array of results (see results_array()), when all
+    /// of them are over.
+    static void start(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        Nan::HandleScope scope;
+        if (info.Length() != 1) {
+            Nan::ThrowError("invalid number of arguments");
+            return;
+        }
+        SharedPtr<Batch> batch = get_this(info)->batch;
+        if (batch->started) {
+            Nan::ThrowError("batch already started");
+            return;
+        }
+        batch->started = true;
+        batch->handlers.final = wrap_callback(info[0]);
+        if (batch->items.empty()) {
+            v8::Local<v8::Value> argv[] = {results_array(*batch)};
+            call(batch->handlers.final, 1, argv);
+            return;
+        }
+        launch(batch);
+    }
+
+    /// ## Internals
+
+  private:
+    /// The set_value method checks the number of arguments, calls `next` with
+    /// the state of the batch, and returns `this`, for chaining.
+    static void set_value(int argc,
+            const Nan::FunctionCallbackInfo<v8::Value> &info,
+            std::function<void(Batch &)> &&next) {
+        Nan::HandleScope scope;
+        if (info.Length() != argc) {
+            Nan::ThrowError("invalid number of arguments");
+            return;
+        }
+        next(*get_this(info)->batch);
+        info.GetReturnValue().Set(info.This());
+    }
+
+    /// The get_this() method returns the `this` pointer of the class.
+    static NettestBatch *get_this(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        return ObjectWrap::Unwrap<NettestBatch>(info.Holder());
+    }
+
+    /// Batch is the state of the batch.
+    SharedPtr<Batch> batch{new Batch};
+};
+
+} // namespace node
+} // namespace mk
+#endif
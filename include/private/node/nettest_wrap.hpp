@@ -4,14 +4,547 @@
 #ifndef PRIVATE_NODE_NETTEST_WRAP_HPP
 #define PRIVATE_NODE_NETTEST_WRAP_HPP
 
+#include "private/common/jsonl_sink.hpp"
+#include "private/common/log_ring.hpp"
+#include "private/common/throughput_sampler.hpp"
 #include "private/node/async.hpp"
+#include "private/node/metrics.hpp"
 #include "private/node/wrap_callback.hpp"
 #include <measurement_kit/nettests.hpp>
+#include <cstring>
+#include <map>
+#include <mutex>
 #include <nan.h>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 namespace mk {
 namespace node {
 
+/// # LogBatch
+///
+/// LogBatch accumulates the log lines drained from an async::Context during
+/// a single pass, so that they can be delivered to JavaScript at once. It is
+/// only accessed by libuv's thread.
+class LogBatch {
+  public:
+    /// The levels field contains the level of each log line.
+    std::vector<uint32_t> levels;
+
+    /// The messages field contains the text of each log line.
+    std::vector<std::string> messages;
+};
+
+/// # Handlers
+///
+/// Handlers contains the JavaScript callbacks to which the events of a test
+/// are delivered. It is only accessed by libuv's thread.
+class Handlers {
+  public:
+    /// The following fields are the callbacks for each type of event. Each
+    /// of them is null until the corresponding callback setter is called.
+    SharedPtr<Nan::Callback> begin;
+    SharedPtr<Nan::Callback> end;
+    SharedPtr<Nan::Callback> entry;
+    SharedPtr<Nan::Callback> entry_object;
+    SharedPtr<Nan::Callback> entry_buffer;
+    SharedPtr<Nan::Callback> event;
+    SharedPtr<Nan::Callback> log;
+    SharedPtr<Nan::Callback> log_batch;
+    SharedPtr<Nan::Callback> progress;
+    SharedPtr<Nan::Callback> data_usage;
+    SharedPtr<Nan::Callback> final;
+    SharedPtr<Nan::Callback> throughput;
+
+    /// The lines field accumulates log lines for `log_batch`.
+    LogBatch lines;
+
+    /// The sampler field is the source of the samples for `throughput`.
+    SharedPtr<ThroughputSampler> sampler;
+
+    /// The samples field is where we take the samples from `sampler`. We
+    /// keep it here so its storage is reused.
+    std::vector<double> samples;
+};
+
+/// The call() function calls `callback`, if set, with the given arguments.
+static inline void call(const SharedPtr<Nan::Callback> &callback, int argc,
+        v8::Local<v8::Value> argv[]) {
+    if (callback) {
+        callback->Call(argc, argv);
+    }
+}
+
+/// The new_key() function returns `key` as an internalized V8 string. Since
+/// V8 keeps a single copy of internalized strings, keys that appear in many
+/// entries (or many times in an entry) are not allocated over and over, and
+/// objects using them share the same hidden class.
+static inline v8::Local<v8::String> new_key(const std::string &key) {
+    return v8::String::NewFromUtf8(v8::Isolate::GetCurrent(), key.data(),
+            v8::NewStringType::kInternalized, (int)key.size())
+            .ToLocalChecked();
+}
+
+/// The to_value() function converts the JSON `tree` into a V8 value. We
+/// create arrays with their final size, so they are not grown while filling
+/// them. The caller must have opened a handle scope.
+static inline v8::Local<v8::Value> to_value(const Json &tree) {
+    switch (tree.type()) {
+    case Json::value_t::null:
+        return Nan::Null();
+    case Json::value_t::boolean:
+        return Nan::New(tree.get<bool>());
+    case Json::value_t::number_integer:
+    case Json::value_t::number_unsigned:
+    case Json::value_t::number_float:
+        return Nan::New(tree.get<double>());
+    case Json::value_t::string:
+        return Nan::New(tree.get_ref<const std::string &>()).ToLocalChecked();
+    case Json::value_t::array: {
+        v8::Local<v8::Array> array = Nan::New<v8::Array>((int)tree.size());
+        uint32_t index = 0;
+        for (const Json &value : tree) {
+            Nan::Set(array, index++, to_value(value));
+        }
+        return array;
+    }
+    case Json::value_t::object: {
+        v8::Local<v8::Object> object = Nan::New<v8::Object>();
+        for (auto it = tree.begin(); it != tree.end(); ++it) {
+            Nan::Set(object, new_key(it.key()), to_value(it.value()));
+        }
+        return object;
+    }
+    default:
+        return Nan::Undefined();
+    }
+}
+
+/// The new_buffer() function moves `s` into a heap holder and returns a Node
+/// Buffer backed by the memory of such holder, which is deleted when the
+/// Buffer is garbage collected. Hence, no byte is copied.
+static inline v8::Local<v8::Object> new_buffer(std::string &&s) {
+    std::string *holder = new std::string{std::move(s)};
+    return Nan::NewBuffer(&(*holder)[0], (uint32_t)holder->size(),
+            [](char *, void *hint) { delete static_cast<std::string *>(hint); },
+            holder)
+            .ToLocalChecked();
+}
+
+/// The flush_throughput() function delivers to the `throughput` callback the
+/// samples taken since the previous call, if any, as a Float64Array where
+/// each sample takes three consecutive elements (see ThroughputSampler).
+static inline void flush_throughput(Handlers &handlers) {
+    if (!handlers.throughput) {
+        return;
+    }
+    handlers.sampler->take(handlers.samples);
+    if (handlers.samples.empty()) {
+        return;
+    }
+    Nan::HandleScope scope;
+    size_t count = handlers.samples.size();
+    v8::Local<v8::ArrayBuffer> buffer = v8::ArrayBuffer::New(
+            v8::Isolate::GetCurrent(), count * sizeof(double));
+    memcpy(buffer->GetContents().Data(), handlers.samples.data(),
+            count * sizeof(double));
+    v8::Local<v8::Value> argv[] = {v8::Float64Array::New(buffer, 0, count)};
+    call(handlers.throughput, 1, argv);
+}
+
+/// The dispatch() function is the single place where the events of a test
+/// are delivered to JavaScript, in the context of libuv's loop.
+static inline void dispatch(Handlers &handlers, async::Event &ev) {
+    // Implementation note: even if it seems superfluous, here we must add
+    // the scope otherwise calling the callbacks is going to fail because
+    // it's missing a scope.
+    Nan::HandleScope scope;
+    switch (ev.type) {
+    case async::EventType::begin:
+        call(handlers.begin, 0, nullptr);
+        break;
+    case async::EventType::end:
+        flush_throughput(handlers);
+        call(handlers.end, 0, nullptr);
+        break;
+    case async::EventType::entry:
+        // Note: the entry is parsed only if `entry_object` is set, and it is
+        // delivered as a string if MK's JSON was not valid
+        if (!ev.tree.is_null()) {
+            if (handlers.entry_object) {
+                v8::Local<v8::Value> argv[] = {to_value(ev.tree)};
+                call(handlers.entry_object, 1, argv);
+            }
+            if (handlers.entry || handlers.entry_buffer) {
+                ev.payload = ev.tree.dump();
+            }
+        } else if (handlers.entry_object) {
+            v8::Local<v8::Value> argv[] = {
+                    Nan::New(ev.payload).ToLocalChecked()};
+            call(handlers.entry_object, 1, argv);
+        }
+        if (handlers.entry) {
+            v8::Local<v8::Value> argv[] = {
+                    Nan::New(ev.payload).ToLocalChecked()};
+            call(handlers.entry, 1, argv);
+        }
+        if (handlers.entry_buffer) {
+            // Note: this must come last, because we take `payload`
+            v8::Local<v8::Value> argv[] = {new_buffer(std::move(ev.payload))};
+            call(handlers.entry_buffer, 1, argv);
+        }
+        break;
+    case async::EventType::event:
+        if (handlers.event) {
+            v8::Local<v8::Value> argv[] = {
+                    Nan::New(ev.payload).ToLocalChecked()};
+            call(handlers.event, 1, argv);
+        }
+        break;
+    case async::EventType::log:
+        if (handlers.log_batch) {
+            handlers.lines.levels.push_back(ev.level);
+            handlers.lines.messages.push_back(ev.payload);
+        }
+        if (handlers.log) {
+            v8::Local<v8::Value> argv[] = {
+                    Nan::New(ev.level), Nan::New(ev.payload).ToLocalChecked()};
+            call(handlers.log, 2, argv);
+        }
+        break;
+    case async::EventType::progress:
+        if (handlers.progress) {
+            v8::Local<v8::Value> argv[] = {Nan::New(ev.values[0]),
+                    Nan::New(ev.payload).ToLocalChecked()};
+            call(handlers.progress, 2, argv);
+        }
+        break;
+    case async::EventType::data_usage: {
+        v8::Local<v8::Value> argv[] = {
+                Nan::New(ev.values[0]), Nan::New(ev.values[1])};
+        call(handlers.data_usage, 2, argv);
+        break;
+    }
+    case async::EventType::final:
+        flush_throughput(handlers);
+        call(handlers.final, 0, nullptr);
+        break;
+    case async::EventType::closure:
+        break; // Closures are run by the async bridge itself
+    }
+}
+
+/// The flush_log_batch() function delivers to the `log_batch` callback the
+/// log lines accumulated since the previous call, if any.
+static inline void flush_log_batch(Handlers &handlers) {
+    LogBatch &batch = handlers.lines;
+    if (batch.levels.empty() || !handlers.log_batch) {
+        return;
+    }
+    Nan::HandleScope scope;
+    uint32_t count = (uint32_t)batch.levels.size();
+    v8::Local<v8::Array> levels = Nan::New<v8::Array>(count);
+    v8::Local<v8::Array> messages = Nan::New<v8::Array>(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        Nan::Set(levels, i, Nan::New(batch.levels[i]));
+        Nan::Set(messages, i, Nan::New(batch.messages[i]).ToLocalChecked());
+    }
+    batch.levels.clear();
+    batch.messages.clear();
+    v8::Local<v8::Value> argv[] = {levels, messages};
+    call(handlers.log_batch, 2, argv);
+}
+
+/// The stats_object() function converts `stats` into a JavaScript object. The
+/// `latencyHistogram` field is an array whose element zero counts the events
+/// delivered less than one microsecond after being suspended, and element `i`
+/// counts those delivered within [2^(i-1), 2^i) microseconds. The caller must
+/// have opened a handle scope.
+static inline v8::Local<v8::Object> stats_object(const async::Stats &stats) {
+    v8::Local<v8::Object> result = Nan::New<v8::Object>();
+    auto set = [&result](const char *name, double value) {
+        Nan::Set(result, Nan::New(name).ToLocalChecked(), Nan::New(value));
+    };
+    set("events", (double)stats.events);
+    set("wakeups", (double)stats.wakeups);
+    set("resumed", (double)stats.resumed);
+    set("coalesced", (double)stats.coalesced);
+    set("maxQueueDepth", (double)stats.max_depth);
+    set("passes", (double)stats.passes);
+    set("maxEventsPerPass", (double)stats.max_pass_events);
+    set("callbackTimeMs", (double)stats.callback_ns / 1e06);
+    v8::Local<v8::Array> latency =
+            Nan::New<v8::Array>((int)async::Histogram::size);
+    for (uint32_t i = 0; i < async::Histogram::size; ++i) {
+        Nan::Set(latency, i, Nan::New((double)stats.latency.buckets[i]));
+    }
+    Nan::Set(result, Nan::New("latencyHistogram").ToLocalChecked(), latency);
+    return result;
+}
+
+/// The apply_options() function sets on `nettest` all the options in
+/// `object`. Boolean values are mapped to "1" and "0", and all other values
+/// are converted to string. The caller must have opened a handle scope.
+template <typename Nettest>
+static void apply_options(Nettest &nettest, v8::Local<v8::Object> object) {
+    v8::Local<v8::Array> keys =
+            Nan::GetOwnPropertyNames(object).ToLocalChecked();
+    for (uint32_t i = 0; i < keys->Length(); ++i) {
+        v8::Local<v8::Value> key = Nan::Get(keys, i).ToLocalChecked();
+        v8::Local<v8::Value> value = Nan::Get(object, key).ToLocalChecked();
+        std::string s;
+        if (value->IsBoolean()) {
+            s = value->BooleanValue() ? "1" : "0";
+        } else {
+            s = *v8::String::Utf8Value{value->ToString()};
+        }
+        nettest.set_option(*v8::String::Utf8Value{key->ToString()}, s);
+    }
+}
+
+/// # Inputs
+///
+/// Inputs adds inputs in bulk to a test, counting them.
+///
+/// ### Fields
+class Inputs {
+  public:
+    /// The added field counts the inputs added.
+    uint32_t added = 0;
+
+    /// The invalid field counts the inputs rejected because they contain
+    /// whitespace or control characters. Empty inputs are just skipped.
+    uint32_t invalid = 0;
+
+    /// The add() method removes leading and trailing whitespace from the
+    /// input in [begin, end) and, if it is valid, adds it to `nettest`.
+    template <typename Nettest>
+    void add(Nettest &nettest, const char *begin, const char *end) {
+        auto is_space = [](char c) {
+            return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+        };
+        while (begin < end && is_space(*begin)) {
+            ++begin;
+        }
+        while (end > begin && is_space(end[-1])) {
+            --end;
+        }
+        if (begin == end) {
+            return;
+        }
+        for (const char *p = begin; p < end; ++p) {
+            if ((unsigned char)*p <= ' ' || *p == 0x7f) {
+                invalid += 1;
+                return;
+            }
+        }
+        nettest.add_input(std::string{begin, end});
+        added += 1;
+    }
+
+    /// The to_object() method returns the counters as a JavaScript object.
+    v8::Local<v8::Object> to_object() const {
+        v8::Local<v8::Object> result = Nan::New<v8::Object>();
+        Nan::Set(result, Nan::New("added").ToLocalChecked(), Nan::New(added));
+        Nan::Set(result, Nan::New("invalid").ToLocalChecked(),
+                Nan::New(invalid));
+        return result;
+    }
+};
+
+/// # Constructors
+///
+/// Constructors contains the Node constructor of a class exported by this
+/// module (e.g. NettestWrap) for each isolate that loaded this module. We
+/// need one per isolate because worker threads have their own isolate and a
+/// persistent handle cannot be shared between isolates.
+class Constructors {
+  public:
+    /// The mutex protects `by_isolate`, since isolates run in different
+    /// threads. We only need it to find the constructor of an isolate, since
+    /// std::map does not move elements when other elements are added.
+    std::mutex mutex;
+
+    /// The by_isolate field maps an isolate to its constructor.
+    std::map<v8::Isolate *, Nan::Persistent<v8::Function>> by_isolate;
+
+    /// The current() method returns the constructor of the current isolate.
+    Nan::Persistent<v8::Function> &current() {
+        std::unique_lock<std::mutex> _{mutex};
+        return by_isolate[v8::Isolate::GetCurrent()];
+    }
+
+    /// The store() method stores `function` as the constructor of the
+    /// current isolate and registers `cleanup`, which must call forget(), to
+    /// be called with the isolate when its environment is torn down (e.g. a
+    /// worker thread exits). Removing the hook first is needed because Node
+    /// aborts if the same hook is added twice, which happens if this module
+    /// is initialized twice.
+    void store(v8::Local<v8::Function> function, void (*cleanup)(void *)) {
+        current().Reset(function);
+        v8::Isolate *isolate = v8::Isolate::GetCurrent();
+        ::node::RemoveEnvironmentCleanupHook(isolate, cleanup, isolate);
+        ::node::AddEnvironmentCleanupHook(isolate, cleanup, isolate);
+    }
+
+    /// The forget() method forgets about the constructor of `isolate`.
+    void forget(v8::Isolate *isolate) {
+        std::unique_lock<std::mutex> _{mutex};
+        auto it = by_isolate.find(isolate);
+        if (it != by_isolate.end()) {
+            it->second.Reset();
+            by_isolate.erase(it);
+        }
+    }
+};
+
+/// # SamplesThroughput
+///
+/// SamplesThroughput tells whether a test emits the speed events used by
+/// ThroughputSampler, in which case NettestWrap has an on_throughput setter.
+template <typename Nettest> class SamplesThroughput : public std::false_type {};
+
+template <>
+class SamplesThroughput<nettests::DashTest> : public std::true_type {};
+
+template <>
+class SamplesThroughput<nettests::MultiNdtTest> : public std::true_type {};
+
+template <>
+class SamplesThroughput<nettests::NdtTest> : public std::true_type {};
+
+/// The install_begin_end() function registers the MK callbacks of `test`
+/// recording the beginning and the end of the test into `metrics` and, if
+/// `begin` and `end` are respectively true, suspending them on `ctx`.
+static inline void install_begin_end(nettests::BaseTest &test,
+        const SharedPtr<async::Context> &ctx, const SharedPtr<Metrics> &metrics,
+        bool begin, bool end) {
+    test.on_begin([ctx, metrics, begin]() {
+        metrics->begin();
+        if (begin) {
+            async::emit<>(ctx, async::EventType::begin, [](async::Event &) {});
+        }
+    });
+    test.on_end([ctx, metrics, end]() {
+        metrics->end();
+        if (end) {
+            async::emit<>(ctx, async::EventType::end, [](async::Event &) {});
+        }
+    });
+}
+
+/// The install_entry() function registers the MK callback of `test`
+/// recording entries into `metrics` and routing them to `sink`, if any,
+/// and, if `deliver` is true, suspending them on `ctx`, parsed by MK's
+/// thread if `parse` is true. Entries of a stopped Context are ignored.
+static inline void install_entry(nettests::BaseTest &test,
+        const SharedPtr<async::Context> &ctx, const SharedPtr<Metrics> &metrics,
+        const SharedPtr<JsonlSink> &sink, bool deliver, bool parse) {
+    test.on_entry([ctx, metrics, sink, deliver, parse](std::string s) {
+        if (*ctx->stopped) {
+            return;
+        }
+        metrics->entry();
+        if (sink) {
+            sink->append(s);
+        }
+        if (!deliver) {
+            return;
+        }
+        // Note: parse before emitting, so that a slow parse does not
+        // hold a queue slot that libuv's thread is waiting for
+        Json tree;
+        if (parse) {
+            try {
+                tree = Json::parse(s);
+            } catch (const std::exception &) {
+                // We deliver the string, see on_entry_object
+            }
+        }
+        // Note: entries may be large, so we move rather than copy
+        async::emit<>(ctx, async::EventType::entry, [&](async::Event &ev) {
+            ev.values[0] = (double)s.size();
+            if (tree.is_null()) {
+                ev.payload = std::move(s);
+            } else {
+                ev.tree = std::move(tree);
+            }
+        });
+    });
+}
+
+/// The install_event() function registers the MK callback of `test` routing
+/// events to `sampler`, if any, and, if `deliver` is true, suspending them
+/// on `ctx`. When the sampler takes a sample, we wake up Node's loop to
+/// deliver it, even if events are not delivered.
+static inline void install_event(nettests::BaseTest &test,
+        const SharedPtr<async::Context> &ctx,
+        const SharedPtr<ThroughputSampler> &sampler, bool deliver) {
+    if (sampler) {
+        sampler->start(uv_hrtime());
+    }
+    test.on_event([ctx, sampler, deliver](const char *s) {
+        if (*ctx->stopped) {
+            return;
+        }
+        if (deliver) {
+            async::emit<>(ctx, async::EventType::event,
+                    [s](async::Event &ev) { ev.payload.assign(s); });
+        }
+        if (sampler && sampler->on_event(s, uv_hrtime()) && !deliver) {
+            async::wakeup<>(*ctx);
+        }
+    });
+}
+
+/// The install_log() function registers the MK callback of `test` storing
+/// log lines into `ring`, if any, and, if `deliver` is true, suspending on
+/// `ctx` those that are not more verbose than `threshold`. This replaces
+/// MK's default behavior of writing log lines on the standard error.
+static inline void install_log(nettests::BaseTest &test,
+        const SharedPtr<async::Context> &ctx, const SharedPtr<LogRing> &ring,
+        bool deliver, uint32_t threshold) {
+    test.on_log([ctx, ring, deliver, threshold](
+            uint32_t level, const char *s) {
+        if (ring) {
+            ring->push(level, s);
+        }
+        if (!deliver || (level & MK_LOG_VERBOSITY_MASK) > threshold) {
+            return;
+        }
+        async::emit<>(ctx, async::EventType::log, [&](async::Event &ev) {
+            ev.level = level;
+            ev.payload.assign(s);
+        });
+    });
+}
+
+/// The install_progress() function registers the MK callback of `test`
+/// suspending progress events on `ctx`.
+static inline void install_progress(
+        nettests::BaseTest &test, const SharedPtr<async::Context> &ctx) {
+    test.on_progress([ctx](double percentage, const char *s) {
+        async::emit<>(ctx, async::EventType::progress, [&](async::Event &ev) {
+            ev.values[0] = percentage;
+            ev.payload.assign(s);
+        });
+    });
+}
+
+/// The install_data_usage() function registers the MK callback of `test`
+/// suspending the overall data usage on `ctx`.
+static inline void install_data_usage(
+        nettests::BaseTest &test, const SharedPtr<async::Context> &ctx) {
+    test.on_overall_data_usage([ctx](DataUsage du) {
+        async::emit<>(ctx, async::EventType::data_usage,
+                [&du](async::Event &ev) {
+                    ev.values[0] = static_cast<double>(du.down);
+                    ev.values[1] = static_cast<double>(du.up);
+                });
+    });
+}
+
 /// # NettestWrap
 ///
 /// The NettestWrap class template is the Node-visible object. It wraps
@@ -41,12 +574,26 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
     /// 2. this is a template, hence it's more syntax work to instantiate
     ///    also considering that we don't have a C++ file
     ///
-    /// Thus, a static factory makes things simpler.
+    /// Thus, a static factory makes things simpler. The constructor is that
+    /// of the current isolate, since we may be loaded by worker threads.
     static Nan::Persistent<v8::Function> &constructor() {
-        static Nan::Persistent<v8::Function> instance;
+        return constructors().current();
+    }
+
+    /// The static constructors() factory returns the constructors of this
+    /// class for all the isolates.
+    static Constructors &constructors() {
+        static Constructors instance;
         return instance;
     }
 
+    /// The static cleanup() method is called when the environment of the
+    /// `isolate` is torn down (e.g. a worker thread exits) and forgets about
+    /// the constructor of such isolate.
+    static void cleanup(void *isolate) {
+        constructors().forget(static_cast<v8::Isolate *>(isolate));
+    }
+
     /// The initialize() static method will create the function template that
     /// JavaScript will use to create an instance of this class, and will
     /// store such function template into the exports object.
@@ -63,7 +610,11 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
         tpl->InstanceTemplate()->SetInternalFieldCount(1);
         Nan::SetPrototypeMethod(tpl, "add_input", add_input);
         Nan::SetPrototypeMethod(tpl, "add_input_filepath", add_input_filepath);
+        Nan::SetPrototypeMethod(tpl, "add_inputs", add_inputs);
+        Nan::SetPrototypeMethod(tpl, "add_inputs_buffer", add_inputs_buffer);
+        Nan::SetPrototypeMethod(tpl, "set_entry_sink", set_entry_sink);
         Nan::SetPrototypeMethod(tpl, "set_error_filepath", set_error_filepath);
+        Nan::SetPrototypeMethod(tpl, "set_log_buffer", set_log_buffer);
         //
         // Note: `set_options` is deprecated as of v0.8.0-beta.1. Keeping
         // nonetheless the old interface name in here for some time. To avoid
@@ -72,18 +623,33 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
         //
         Nan::SetPrototypeMethod(tpl, "set_options", set_option);
         Nan::SetPrototypeMethod(tpl, "set_option", set_option);
+        Nan::SetPrototypeMethod(tpl, "set_options_object", set_options_object);
         Nan::SetPrototypeMethod(
                 tpl, "set_output_filepath", set_output_filepath);
+        Nan::SetPrototypeMethod(
+                tpl, "set_progress_interval", set_progress_interval);
+        Nan::SetPrototypeMethod(tpl, "set_queue_limit", set_queue_limit);
         Nan::SetPrototypeMethod(tpl, "set_verbosity", set_verbosity);
         Nan::SetPrototypeMethod(tpl, "on_begin", on_begin);
         Nan::SetPrototypeMethod(tpl, "on_end", on_end);
         Nan::SetPrototypeMethod(tpl, "on_entry", on_entry);
+        Nan::SetPrototypeMethod(tpl, "on_entry_buffer", on_entry_buffer);
+        Nan::SetPrototypeMethod(tpl, "on_entry_object", on_entry_object);
         Nan::SetPrototypeMethod(tpl, "on_event", on_event);
         Nan::SetPrototypeMethod(tpl, "on_log", on_log);
+        Nan::SetPrototypeMethod(tpl, "on_log_batch", on_log_batch);
         Nan::SetPrototypeMethod(tpl, "on_progress", on_progress);
         Nan::SetPrototypeMethod(tpl, "on_overall_data_usage", on_overall_data_usage);
+        if (SamplesThroughput<Nettest>::value) {
+            Nan::SetPrototypeMethod(tpl, "on_throughput", on_throughput);
+        }
         Nan::SetPrototypeMethod(tpl, "run", run);
         Nan::SetPrototypeMethod(tpl, "start", start);
+        Nan::SetPrototypeMethod(tpl, "stop", stop);
+        Nan::SetPrototypeMethod(tpl, "dropped_events", dropped_events);
+        Nan::SetPrototypeMethod(tpl, "get_logs", get_logs);
+        Nan::SetPrototypeMethod(tpl, "metrics", metrics);
+        Nan::SetPrototypeMethod(tpl, "stats", stats);
 
         /// Once we have configured the function template, we register it into
         /// the exports, so that it is not garbage collected. This MUST be
@@ -93,8 +659,9 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
 
         /// We also store a copy of `tpl` in `constructor()`, such that
         /// it's possible to deal with the case where `new` is not used when
-        /// an object is constructed (i.e. `let foo = FooTest();`).
-        constructor().Reset(tpl->GetFunction());
+        /// an object is constructed (i.e. `let foo = FooTest();`), and we
+        /// make sure that it is forgotten when the environment goes away.
+        constructors().store(tpl->GetFunction(), cleanup);
     }
 
     /// The make() static method is the JavaScript object "constructor".
@@ -124,7 +691,28 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
 
     /// NettestWrap() is the C++ constructor. It creates an instance of the
     /// async::Context context to route callbacks from C++ to Node.
-    NettestWrap() { async_ctx = async::make<>(); }
+    NettestWrap() {
+        async_ctx = async::make<>(Nan::GetCurrentEventLoop());
+        limits = async_ctx->limits;
+        counters = async_ctx->stats;
+        stopped = async_ctx->stopped;
+        async_ctx->dispatch = [
+            handlers = handlers, metrics = run_metrics
+        ](async::Event &ev) {
+            // Note: count before dispatch(), which may take the payload, and
+            // use the size of the entry before it was parsed, if it was
+            size_t type = (size_t)ev.type;
+            metrics->delivered[type] += 1;
+            metrics->delivered_bytes[type] +=
+                    (ev.type == async::EventType::entry)
+                            ? (uint64_t)ev.values[0]
+                            : (uint64_t)ev.payload.size();
+            if (ev.type == async::EventType::final) {
+                metrics->finish();
+            }
+            dispatch(*handlers, ev);
+        };
+    }
 
     /// ## Value Setters
 
@@ -149,6 +737,88 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
         });
     }
 
+    /// The add_inputs method adds all the strings in the array passed as
+    /// argument as inputs, removing leading and trailing whitespace, and
+    /// returns an object telling how many were `added` and how many were
+    /// `invalid`. This is much faster than calling add_input for each input.
+    static void add_inputs(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        Nan::HandleScope scope;
+        if (info.Length() != 1 || !info[0]->IsArray()) {
+            Nan::ThrowError("invalid arguments");
+            return;
+        }
+        NettestWrap *self = get_this(info);
+        v8::Local<v8::Array> array = info[0].As<v8::Array>();
+        Inputs inputs;
+        for (uint32_t i = 0; i < array->Length(); ++i) {
+            Nan::HandleScope element_scope;
+            v8::Local<v8::Value> value = Nan::Get(array, i).ToLocalChecked();
+            if (!value->IsString()) {
+                inputs.invalid += 1;
+                continue;
+            }
+            v8::String::Utf8Value s{value->ToString()};
+            inputs.add(self->nettest, *s, *s + s.length());
+        }
+        info.GetReturnValue().Set(inputs.to_object());
+    }
+
+    /// The add_inputs_buffer method is like add_inputs, except that inputs
+    /// are the lines of the Buffer passed as argument, e.g. the content of a
+    /// file read with `fs.readFile()`. Empty lines are skipped.
+    static void add_inputs_buffer(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        Nan::HandleScope scope;
+        if (info.Length() != 1 || !::node::Buffer::HasInstance(info[0])) {
+            Nan::ThrowError("invalid arguments");
+            return;
+        }
+        NettestWrap *self = get_this(info);
+        const char *begin = ::node::Buffer::Data(info[0]);
+        const char *end = begin + ::node::Buffer::Length(info[0]);
+        Inputs inputs;
+        while (begin < end) {
+            const char *eol = (const char *)memchr(begin, '\n', end - begin);
+            if (eol == nullptr) {
+                eol = end;
+            }
+            inputs.add(self->nettest, begin, eol);
+            begin = eol + 1;
+        }
+        info.GetReturnValue().Set(inputs.to_object());
+    }
+
+    /// The set_entry_sink setter tells MK's thread to append entries to the
+    /// file whose path is the first argument, one per line, through a native
+    /// writer thread, regardless of the entry callbacks. The second and the
+    /// third arguments are the size in bytes past which the file is rotated
+    /// (zero means never) and the number of rotated files to keep (at least
+    /// one, see JsonlSink). The fourth argument tells when to fsync():
+    /// "none", "batch" or "always".
+    static void set_entry_sink(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(4, info, [&info](NettestWrap *self) {
+            std::string path = *v8::String::Utf8Value{info[0]->ToString()};
+            std::string fsync = *v8::String::Utf8Value{info[3]->ToString()};
+            JsonlSink::Fsync policy = JsonlSink::Fsync::none;
+            if (fsync == "batch") {
+                policy = JsonlSink::Fsync::batch;
+            } else if (fsync == "always") {
+                policy = JsonlSink::Fsync::always;
+            } else if (fsync != "none") {
+                Nan::ThrowError("invalid fsync policy");
+                return;
+            }
+            try {
+                self->sink.reset(new JsonlSink{path,
+                        (uint64_t)info[1]->NumberValue(),
+                        (uint64_t)info[2]->NumberValue(), policy});
+            } catch (const std::runtime_error &) {
+                Nan::ThrowError("cannot open entry sink");
+            }
+        });
+    }
+
     /// The set_error_filepath setter sets the path where logs will be written.
     /// Not setting the error filepath will prevent logs from being written on
     /// disk.
@@ -160,6 +830,26 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
         });
     }
 
+    /// The set_log_buffer setter tells to keep the most recent log lines in
+    /// memory, such that they can be fetched with get_logs(). The arguments
+    /// are the maximum number of lines and the maximum number of bytes to
+    /// keep, zero meaning no limit, but at least one of them must be set,
+    /// lest the buffer grow for the whole test. Lines are stored by MK's
+    /// thread without waking up Node's loop, hence this is cheap enough to
+    /// be used along with, or instead of, on_log.
+    static void set_log_buffer(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(2, info, [&info](NettestWrap *self) {
+            uint64_t max_lines = (uint64_t)info[0]->NumberValue();
+            uint64_t max_bytes = (uint64_t)info[1]->NumberValue();
+            if (max_lines == 0 && max_bytes == 0) {
+                Nan::ThrowError("the log buffer must be bounded");
+                return;
+            }
+            self->log_ring.reset(new LogRing{max_lines, max_bytes});
+        });
+    }
+
     /// The set_option setter allows to set test-specific options. You should
     /// consult MK documentation for more information on available options.
     static void set_option(const Nan::FunctionCallbackInfo<v8::Value> &info) {
@@ -170,6 +860,20 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
         });
     }
 
+    /// The set_options_object setter sets all the options in the object
+    /// passed as argument, in a single call. Boolean values are mapped to
+    /// "1" and "0", and all other values are converted to string.
+    static void set_options_object(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(1, info, [&info](NettestWrap *self) {
+            if (!info[0]->IsObject()) {
+                Nan::ThrowError("invalid arguments");
+                return;
+            }
+            apply_options(self->nettest, info[0].As<v8::Object>());
+        });
+    }
+
     /// The set_output_filepath setter sets the path where test report will be
     /// written. Not setting the output filepath will cause MK to try to write
     /// the report on an filepath with a test- and time-dependent name.
@@ -181,6 +885,44 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
         });
     }
 
+    /// The set_progress_interval setter tells the async bridge to coalesce
+    /// progress and data usage events, such that only the latest value is
+    /// delivered, at most once every the number of milliseconds passed as
+    /// argument and once per drain pass. Held back values are delivered
+    /// before the end of the test.
+    static void set_progress_interval(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(1, info, [&info](NettestWrap *self) {
+            self->async_ctx->coalesce = true;
+            self->async_ctx->coalesce_interval_ns =
+                    (uint64_t)(info[0]->NumberValue() * 1e06);
+        });
+    }
+
+    /// The set_queue_limit setter bounds the number of events of a class that
+    /// may be waiting for Node's loop. The first argument is the class, i.e.
+    /// "log", "event" or "progress". The second argument is the maximum
+    /// number of waiting events, zero meaning no limit, past which events
+    /// are dropped. The third argument, if nonzero, tells to keep one every
+    /// that many events past the limit rather than dropping all of them.
+    /// Other events (e.g. entries) are never dropped. Use dropped_events()
+    /// to know how many events have been dropped.
+    static void set_queue_limit(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(3, info, [&info](NettestWrap *self) {
+            std::string klass = *v8::String::Utf8Value{info[0]->ToString()};
+            for (int i = 0; i < (int)async::EventClass::other; ++i) {
+                if (klass == event_class_names()[i]) {
+                    async::Limit &limit = self->limits->by_class[i];
+                    limit.max = (uint64_t)info[1]->NumberValue();
+                    limit.sample_every = (uint64_t)info[2]->NumberValue();
+                    return;
+                }
+            }
+            Nan::ThrowError("invalid event class");
+        });
+    }
+
     /// The set_verbosity setter allows to set logging verbosity. Zero is
     /// equivalent to WARNING, one to INFO, two to DEBUG and more than two
     /// makes MK even more verbose.
@@ -197,17 +939,7 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
     /// beginning of the network test.
     static void on_begin(const Nan::FunctionCallbackInfo<v8::Value> &info) {
         set_value(1, info, [&info](NettestWrap *self) {
-            self->nettest.on_begin([
-                async_ctx = self->async_ctx, callback = wrap_callback(info[0])
-            ]() {
-                async::suspend<>(async_ctx, [callback]() {
-                    // Implementation note: even if it seems superfluous, here
-                    // we must add the scope otherwise the following call is
-                    // going to fail because it's missing a scope.
-                    Nan::HandleScope scope;
-                    callback->Call(0, nullptr);
-                });
-            });
+            self->handlers->begin = wrap_callback(info[0]);
         });
     }
 
@@ -215,14 +947,7 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
     /// measurements have been performed and before closing the report.
     static void on_end(const Nan::FunctionCallbackInfo<v8::Value> &info) {
         set_value(1, info, [&info](NettestWrap *self) {
-            self->nettest.on_end([
-                async_ctx = self->async_ctx, callback = wrap_callback(info[0])
-            ]() {
-                async::suspend<>(async_ctx, [callback]() {
-                    Nan::HandleScope scope;
-                    callback->Call(0, nullptr);
-                });
-            });
+            self->handlers->end = wrap_callback(info[0]);
         });
     }
 
@@ -232,17 +957,30 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
     /// measurement. The callback receives a serialized JSON as argument.
     static void on_entry(const Nan::FunctionCallbackInfo<v8::Value> &info) {
         set_value(1, info, [&info](NettestWrap *self) {
-            self->nettest.on_entry([
-                async_ctx = self->async_ctx, callback = wrap_callback(info[0])
-            ](std::string s) {
-                async::suspend<>(async_ctx, [callback, s]() {
-                    Nan::HandleScope scope;
-                    const int argc = 1;
-                    v8::Local<v8::Value> argv[argc] = {
-                            Nan::New(s).ToLocalChecked()};
-                    callback->Call(argc, argv);
-                });
-            });
+            self->handlers->entry = wrap_callback(info[0]);
+        });
+    }
+
+    /// The on_entry_buffer setter is like on_entry, except that the entry is
+    /// delivered as a Buffer backed by the very memory in which MK wrote it,
+    /// so it is never copied or transcoded. This is convenient when entries
+    /// are only written somewhere else.
+    static void on_entry_buffer(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(1, info, [&info](NettestWrap *self) {
+            self->handlers->entry_buffer = wrap_callback(info[0]);
+        });
+    }
+
+    /// The on_entry_object setter is like on_entry, except that the entry is
+    /// parsed by MK's thread and delivered as a JavaScript object, so that
+    /// parsing large entries does not block libuv's loop. If on_entry is also
+    /// set, it receives the entry serialized again.
+    static void on_entry_object(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(1, info, [&info](NettestWrap *self) {
+            self->handlers->entry_object = wrap_callback(info[0]);
+            self->parse_entries = true;
         });
     }
 
@@ -250,39 +988,43 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
     /// to report test-specific events that occurred.
     static void on_event(const Nan::FunctionCallbackInfo<v8::Value> &info) {
         set_value(1, info, [&info](NettestWrap *self) {
-            self->nettest.on_event([
-                async_ctx = self->async_ctx, callback = wrap_callback(info[0])
-            ](const char *s) {
-                async::suspend<>(async_ctx, [
-                        callback, s = std::string(s)
-                ]() {
-                    Nan::HandleScope scope;
-                    const int argc = 1;
-                    v8::Local<v8::Value> argv[argc] = {
-                            Nan::New(s).ToLocalChecked()};
-                    callback->Call(argc, argv);
-                });
-            });
+            self->handlers->event = wrap_callback(info[0]);
         });
     }
 
     /// The on_log setter allows to set the callback called for each log line
     /// emitted by the test. Not setting this callback means that MK will
     /// attempt to write logs on the standard error.
+    ///
+    /// The optional second argument is an object whose `minLevel` field is
+    /// the most verbose level to deliver (e.g. MK_LOG_INFO). Lines that are
+    /// more verbose are discarded by MK's thread, so they are neither copied
+    /// nor cause wakeups of Node's loop. The threshold also applies to the
+    /// lines delivered to on_log_batch.
     static void on_log(const Nan::FunctionCallbackInfo<v8::Value> &info) {
-        set_value(1, info, [&info](NettestWrap *self) {
-            self->nettest.on_log([
-                async_ctx = self->async_ctx, callback = wrap_callback(info[0])
-            ](uint32_t level, const char *s) {
-                async::suspend<>(
-                        async_ctx, [callback, level, s = std::string(s) ]() {
-                    Nan::HandleScope scope;
-                    const int argc = 2;
-                    v8::Local<v8::Value> argv[argc] = {Nan::New(level),
-                            Nan::New(s).ToLocalChecked()};
-                    callback->Call(argc, argv);
+        set_log_value(info, [&info](NettestWrap *self) {
+            self->handlers->log = wrap_callback(info[0]);
+        });
+    }
+
+    /// The on_log_batch setter is like on_log except that the callback is
+    /// called at most once per wakeup of Node's loop, with two arrays of the
+    /// same length containing, respectively, the levels and the messages of
+    /// all the log lines received since the previous call. Lines are thus
+    /// delivered after the other events processed during the same wakeup.
+    /// Like on_log, it takes an optional `{minLevel}` second argument.
+    static void on_log_batch(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_log_value(info, [&info](NettestWrap *self) {
+            if (!self->handlers->log_batch) {
+                self->async_ctx->on_drained.push_back([
+                    handlers = self->handlers, stopped = self->stopped
+                ]() {
+                    if (!*stopped) {
+                        flush_log_batch(*handlers);
+                    }
                 });
-            });
+            }
+            self->handlers->log_batch = wrap_callback(info[0]);
         });
     }
 
@@ -290,20 +1032,8 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
     /// about the progress of the test in percentage.
     static void on_progress(const Nan::FunctionCallbackInfo<v8::Value> &info) {
         set_value(1, info, [&info](NettestWrap *self) {
-            self->nettest.on_progress([
-                async_ctx = self->async_ctx, callback = wrap_callback(info[0])
-            ](double percentage, const char *s) {
-                async::suspend<>(async_ctx, [
-                        callback, percentage, s = std::string(s)
-                ]() {
-                    Nan::HandleScope scope;
-                    const int argc = 2;
-                    v8::Local<v8::Value> argv[argc] = {
-                            Nan::New(percentage),
-                            Nan::New(s).ToLocalChecked()};
-                    callback->Call(argc, argv);
-                });
-            });
+            self->handlers->progress = wrap_callback(info[0]);
+            install_progress(self->nettest, self->async_ctx);
         });
     }
 
@@ -311,27 +1041,47 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
     /// the overall data used by the test is available.
     static void on_overall_data_usage(const Nan::FunctionCallbackInfo<v8::Value> &info) {
         set_value(1, info, [&info](NettestWrap *self) {
-            self->nettest.on_overall_data_usage([
-                async_ctx = self->async_ctx, callback = wrap_callback(info[0])
-            ](DataUsage du) {
-                async::suspend<>(async_ctx, [callback, du]() {
-                    Nan::HandleScope scope;
-                    const int argc = 2;
-                    v8::Local<v8::Value> argv[argc] = {
-                            Nan::New(static_cast<double>(du.down)),
-                            Nan::New(static_cast<double>(du.up))};
-                    callback->Call(argc, argv);
+            self->handlers->data_usage = wrap_callback(info[0]);
+            install_data_usage(self->nettest, self->async_ctx);
+        });
+    }
+
+    /// The on_throughput setter, which only exists for the tests emitting
+    /// speed events (see SamplesThroughput), allows to set the callback
+    /// called with the throughput samples taken since the previous call, at
+    /// most once per wakeup of Node's loop and before the end of the test.
+    /// Samples are delivered as a Float64Array containing, for each sample,
+    /// the milliseconds since the test started, and the bytes received and
+    /// sent so far (see ThroughputSampler). The second argument is the
+    /// minimum number of milliseconds between samples.
+    static void on_throughput(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        set_value(2, info, [&info](NettestWrap *self) {
+            if (!self->handlers->throughput) {
+                self->async_ctx->on_drained.push_back([
+                    handlers = self->handlers, stopped = self->stopped
+                ]() {
+                    if (!*stopped) {
+                        flush_throughput(*handlers);
+                    }
                 });
-            });
+            }
+            self->handlers->throughput = wrap_callback(info[0]);
+            self->handlers->sampler.reset(new ThroughputSampler{
+                    (uint64_t)(info[1]->NumberValue() * 1e06)});
         });
     }
+
     // clang-format on
 
     /// ## runners
 
     /// The run method runs the test synchronously. This will block Node until
     /// the test is over. Perhaps not what you want in the common case, but
-    /// it may be useful in some specific corner cases.
+    /// it may be useful in some specific corner cases. The test runs in MK's
+    /// background thread, while the calling thread delivers the callbacks as
+    /// they arrive, in order, and MK's thread waits when too many of them
+    /// are pending, so that memory stays bounded (see async::Gate).
     static void run(const Nan::FunctionCallbackInfo<v8::Value> &info) {
         run_or_start(0, info);
     }
@@ -345,6 +1095,173 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
         run_or_start(1, info);
     }
 
+    /// The stop method tells that we are not interested in the test anymore.
+    /// MK cannot interrupt a running test, hence the test goes on in MK's
+    /// background thread until it is over, but from now on its entries are
+    /// not written into the entry sink and no callback is called, except
+    /// the callback passed to start(), which tells when MK is done with the
+    /// test. Events suspended but not delivered yet are discarded as well.
+    static void stop(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        Nan::HandleScope scope;
+        if (info.Length() != 0) {
+            Nan::ThrowError("invalid number of arguments");
+            return;
+        }
+        get_this(info)->stopped->store(true);
+        info.GetReturnValue().Set(info.This());
+    }
+
+    /// ## Getters
+
+    /// The dropped_events getter returns an object telling how many events
+    /// of each class have been dropped because of the limits configured with
+    /// set_queue_limit(). It can also be called after the test is over.
+    static void dropped_events(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        Nan::HandleScope scope;
+        if (info.Length() != 0) {
+            Nan::ThrowError("invalid number of arguments");
+            return;
+        }
+        SharedPtr<async::Limits> limits = get_this(info)->limits;
+        v8::Local<v8::Object> result = Nan::New<v8::Object>();
+        for (int i = 0; i < (int)async::EventClass::other; ++i) {
+            v8::Local<v8::String> name =
+                    Nan::New(event_class_names()[i]).ToLocalChecked();
+            double dropped = (double)limits->by_class[i].dropped.load();
+            Nan::Set(result, name, Nan::New(dropped));
+        }
+        info.GetReturnValue().Set(result);
+    }
+
+    /// The get_logs getter returns the log lines kept because of
+    /// set_log_buffer(), as an object with the `levels` and `messages`
+    /// arrays (as for on_log_batch), `next`, the number of the last line
+    /// returned, and `missed`, the number of lines evicted before they could
+    /// be returned. The optional argument is an object whose `since` field
+    /// tells to only return the lines following the line with that number
+    /// (pass the previous `next` to get only new lines), and whose
+    /// `maxLines` field bounds the number of lines returned. It can also be
+    /// called after the test is over.
+    static void get_logs(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        Nan::HandleScope scope;
+        if (info.Length() > 1) {
+            Nan::ThrowError("invalid number of arguments");
+            return;
+        }
+        uint64_t since = 0, max_lines = 0;
+        if (info.Length() == 1) {
+            if (!info[0]->IsObject()) {
+                Nan::ThrowError("invalid arguments");
+                return;
+            }
+            v8::Local<v8::Object> options = info[0].As<v8::Object>();
+            v8::Local<v8::Value> value =
+                    Nan::Get(options, Nan::New("since").ToLocalChecked())
+                            .ToLocalChecked();
+            if (value->IsNumber()) {
+                since = (uint64_t)value->NumberValue();
+            }
+            value = Nan::Get(options, Nan::New("maxLines").ToLocalChecked())
+                            .ToLocalChecked();
+            if (value->IsNumber()) {
+                max_lines = (uint64_t)value->NumberValue();
+            }
+        }
+        std::vector<LogRing::Line> lines;
+        uint64_t missed = 0;
+        if (get_this(info)->log_ring) {
+            missed = get_this(info)->log_ring->get(since, max_lines, lines);
+        }
+        v8::Local<v8::Array> levels = Nan::New<v8::Array>((int)lines.size());
+        v8::Local<v8::Array> messages = Nan::New<v8::Array>((int)lines.size());
+        for (size_t i = 0; i < lines.size(); ++i) {
+            Nan::Set(levels, (uint32_t)i, Nan::New(lines[i].level));
+            Nan::Set(messages, (uint32_t)i,
+                    Nan::New(lines[i].message).ToLocalChecked());
+        }
+        v8::Local<v8::Object> result = Nan::New<v8::Object>();
+        Nan::Set(result, Nan::New("levels").ToLocalChecked(), levels);
+        Nan::Set(result, Nan::New("messages").ToLocalChecked(), messages);
+        Nan::Set(result, Nan::New("next").ToLocalChecked(),
+                Nan::New((double)(lines.empty() ? since : lines.back().seq)));
+        Nan::Set(result, Nan::New("missed").ToLocalChecked(),
+                Nan::New((double)missed));
+        info.GetReturnValue().Set(result);
+    }
+
+    /// The metrics getter returns the timing and resource metrics of the run,
+    /// as an object with the following fields, where times are milliseconds
+    /// and unknown values (e.g. because the test is not over) are null:
+    ///
+    /// - `wallTimeMs`: from run() or start() to the end of the test;
+    /// - `timeToBeginMs`: from run() or start() to on_begin;
+    /// - `entryGapsMs`: for each entry, the time since the previous entry,
+    ///   or since on_begin for the first one, which allows to spot slow
+    ///   inputs;
+    /// - `cpuTimeMs`: the CPU time of MK's thread (see Metrics);
+    /// - `events`: for each type of event, an object with the `count` and
+    ///   the `bytes` of the events delivered to JavaScript.
+    static void metrics(
+            const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        Nan::HandleScope scope;
+        if (info.Length() != 0) {
+            Nan::ThrowError("invalid number of arguments");
+            return;
+        }
+        Metrics &metrics = *get_this(info)->run_metrics;
+        v8::Local<v8::Object> result = Nan::New<v8::Object>();
+        auto set_ms = [&result](const char *name, uint64_t from, uint64_t to) {
+            v8::Local<v8::Value> value = Nan::Null();
+            if (from != 0 && to != 0) {
+                value = Nan::New((double)(to - from) / 1e06);
+            }
+            Nan::Set(result, Nan::New(name).ToLocalChecked(), value);
+        };
+        {
+            std::unique_lock<std::mutex> _{metrics.mutex};
+            set_ms("wallTimeMs", metrics.started_ns, metrics.finished_ns);
+            set_ms("timeToBeginMs", metrics.started_ns, metrics.begun_ns);
+            v8::Local<v8::Array> gaps =
+                    Nan::New<v8::Array>((int)metrics.entry_gaps_ns.size());
+            for (size_t i = 0; i < metrics.entry_gaps_ns.size(); ++i) {
+                Nan::Set(gaps, (uint32_t)i,
+                        Nan::New((double)metrics.entry_gaps_ns[i] / 1e06));
+            }
+            Nan::Set(result, Nan::New("entryGapsMs").ToLocalChecked(), gaps);
+            set_ms("cpuTimeMs", metrics.first_cpu_ns, metrics.last_cpu_ns);
+        }
+        static const char *const names[Metrics::event_type_count] = {
+                nullptr, "begin", "end", "entry", "event", "log", "progress",
+                "dataUsage", "final"};
+        v8::Local<v8::Object> events = Nan::New<v8::Object>();
+        for (size_t i = 0; i < Metrics::event_type_count; ++i) {
+            if (names[i] == nullptr) {
+                continue; // Closures are not events of the test
+            }
+            v8::Local<v8::Object> type = Nan::New<v8::Object>();
+            Nan::Set(type, Nan::New("count").ToLocalChecked(),
+                    Nan::New((double)metrics.delivered[i]));
+            Nan::Set(type, Nan::New("bytes").ToLocalChecked(),
+                    Nan::New((double)metrics.delivered_bytes[i]));
+            Nan::Set(events, Nan::New(names[i]).ToLocalChecked(), type);
+        }
+        Nan::Set(result, Nan::New("events").ToLocalChecked(), events);
+        info.GetReturnValue().Set(result);
+    }
+
+    /// The stats getter returns the counters of the async bridge for this
+    /// test, as returned by stats_object(). It can also be called after the
+    /// test is over.
+    static void stats(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+        Nan::HandleScope scope;
+        if (info.Length() != 0) {
+            Nan::ThrowError("invalid number of arguments");
+            return;
+        }
+        info.GetReturnValue().Set(stats_object(*get_this(info)->counters));
+    }
+
     /// ## Internals
 
   private:
@@ -359,10 +1276,100 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
             Nan::ThrowError("invalid number of arguments");
             return;
         }
+        if (get_this(info)->started) {
+            Nan::ThrowError("test already started");
+            return;
+        }
         next(get_this(info));
         info.GetReturnValue().Set(info.This());
     }
 
+    /// The set_log_value() method is like set_value() for the setters taking
+    /// a log callback and, optionally, an object with the `minLevel` field,
+    /// which is read into `log_threshold` before calling `next`.
+    static void set_log_value(const Nan::FunctionCallbackInfo<v8::Value> &info,
+            std::function<void(NettestWrap *)> &&next) {
+        Nan::HandleScope scope;
+        if (info.Length() != 2) {
+            set_value(1, info, std::move(next));
+            return;
+        }
+        if (!info[1]->IsObject()) {
+            Nan::ThrowError("invalid arguments");
+            return;
+        }
+        if (get_this(info)->started) {
+            Nan::ThrowError("test already started");
+            return;
+        }
+        v8::Local<v8::Value> level = Nan::Get(info[1].As<v8::Object>(),
+                Nan::New("minLevel").ToLocalChecked()).ToLocalChecked();
+        if (!level->IsUndefined()) {
+            if (!level->IsNumber()) {
+                Nan::ThrowError("invalid log level");
+                return;
+            }
+            get_this(info)->log_threshold =
+                    (uint32_t)level->NumberValue() & MK_LOG_VERBOSITY_MASK;
+        }
+        set_value(2, info, std::move(next));
+    }
+
+    /// The run_capacity constant is the maximum number of events that may be
+    /// pending during run().
+    static constexpr uint64_t run_capacity = 1024;
+
+    /// The event_class_names() method returns the names that JavaScript uses
+    /// for the classes of events that can be bounded, indexed by class.
+    static const char *const *event_class_names() {
+        static const char *const names[] = {"log", "event", "progress"};
+        return names;
+    }
+
+    /// The install_on_begin_end() method registers the MK callbacks routing
+    /// the beginning and the end of the test to on_begin and on_end, if set,
+    /// and recording them into `run_metrics` (see install_begin_end()).
+    void install_on_begin_end() {
+        install_begin_end(nettest, async_ctx, run_metrics, !!handlers->begin,
+                !!handlers->end);
+    }
+
+    /// The install_on_entry() method registers the MK callback recording
+    /// entries into `run_metrics` and routing them to the entry sink, if any,
+    /// and to the entry callbacks, if any (see install_entry()).
+    /// Since MK allows a single entry callback, we install it when the test
+    /// is started, when we know all the destinations.
+    void install_on_entry() {
+        bool deliver = handlers->entry || handlers->entry_object ||
+                       handlers->entry_buffer;
+        install_entry(nettest, async_ctx, run_metrics, sink, deliver,
+                parse_entries);
+    }
+
+    /// The install_on_event() method registers the MK callback routing events
+    /// to the throughput sampler, if any, and to on_event, if set (see
+    /// install_event()).
+    void install_on_event() {
+        bool deliver = !!handlers->event;
+        if (!deliver && !handlers->sampler) {
+            return;
+        }
+        install_event(nettest, async_ctx, handlers->sampler, deliver);
+    }
+
+    /// The install_on_log() method registers the MK callback storing log
+    /// lines into the log buffer, if any, and routing them to either on_log,
+    /// or on_log_batch, or both, if set. Lines more verbose than
+    /// `log_threshold` are not routed. When there is nothing to do with log
+    /// lines, we leave MK's default behavior alone.
+    void install_on_log() {
+        bool deliver = handlers->log || handlers->log_batch;
+        if (!deliver && !log_ring) {
+            return;
+        }
+        install_log(nettest, async_ctx, log_ring, deliver, log_threshold);
+    }
+
     /// The get_this() method is a convenience method used by many others to
     /// quickly get the `this` pointer of the class.
     static NettestWrap *get_this(
@@ -370,7 +1377,8 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
         return ObjectWrap::Unwrap<NettestWrap>(info.Holder());
     }
 
-    /// The run_or_start method implements run() and start().
+    /// The run_or_start method implements run() and start(), which may only
+    /// be called once, since we drop `async_ctx` once the test is started.
     static void run_or_start(
             int argc, const Nan::FunctionCallbackInfo<v8::Value> &info) {
         Nan::HandleScope scope;
@@ -378,23 +1386,51 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
             Nan::ThrowError("invalid number of arguments");
             return;
         }
+        if (get_this(info)->started) {
+            Nan::ThrowError("test already started");
+            return;
+        }
+        get_this(info)->started = true;
+        {
+            std::unique_lock<std::mutex> _{get_this(info)->run_metrics->mutex};
+            get_this(info)->run_metrics->started_ns = uv_hrtime();
+        }
+        get_this(info)->install_on_begin_end();
+        get_this(info)->install_on_entry();
+        get_this(info)->install_on_event();
+        get_this(info)->install_on_log();
         get_this(info)->nettest.on_destroy([
                 async_ctx = get_this(info)->async_ctx
         ]() {
             async::start_delete(async_ctx);
         });
         if (argc >= 1) {
+            get_this(info)->handlers->final = wrap_callback(info[0]);
             get_this(info)->nettest.start([
                 async_ctx = get_this(info)->async_ctx,
-                callback = wrap_callback(info[0])
+                sink = get_this(info)->sink
             ]() {
-                async::suspend<>(async_ctx, [callback]() {
-                    Nan::HandleScope scope;
-                    callback->Call(0, nullptr);
-                });
+                // Note: make sure entries are written before telling the
+                // user that the test is over
+                if (sink) {
+                    sink->flush();
+                }
+                async::emit<>(async_ctx, async::EventType::final,
+                        [](async::Event &) {});
             });
         } else {
-            get_this(info)->nettest.run();
+            SharedPtr<async::Gate> gate{new async::Gate{run_capacity}};
+            get_this(info)->async_ctx->gate = gate;
+            get_this(info)->nettest.start([
+                gate, sink = get_this(info)->sink
+            ]() {
+                if (sink) {
+                    sink->flush();
+                }
+                async::finish(*gate);
+            });
+            async::drain_until_finished<>(get_this(info)->async_ctx);
+            get_this(info)->run_metrics->finish();
         }
         // At this point we don't need to reference async_ctx anymore
         get_this(info)->async_ctx.reset();
@@ -403,6 +1439,41 @@ template <typename Nettest> class NettestWrap : public Nan::ObjectWrap {
     /// Async is the object used to route MK callbacks to libuv loop.
     SharedPtr<async::Context> async_ctx;
 
+    /// Limits are the limits of `async_ctx`, which we keep because we drop
+    /// the reference to `async_ctx` once the test is started.
+    SharedPtr<async::Limits> limits;
+
+    /// Counters are the stats of `async_ctx`, which we keep for the same
+    /// reason as `limits`.
+    SharedPtr<async::Stats> counters;
+
+    /// Sink is the native entry sink, if any.
+    SharedPtr<JsonlSink> sink;
+
+    /// Stopped is the stopped flag of `async_ctx`, which we keep for the same
+    /// reason as `limits`.
+    SharedPtr<std::atomic<bool>> stopped;
+
+    /// Run_metrics are the timing and resource metrics of the run.
+    SharedPtr<Metrics> run_metrics{new Metrics};
+
+    /// Log_ring is the native log buffer, if any.
+    SharedPtr<LogRing> log_ring;
+
+    /// Parse_entries tells whether entries must be parsed by MK's thread.
+    bool parse_entries = false;
+
+    /// Started tells whether run() or start() was called, after which the
+    /// setters throw, since `async_ctx` is gone.
+    bool started = false;
+
+    /// Log_threshold is the most verbose level of the log lines delivered.
+    uint32_t log_threshold = MK_LOG_VERBOSITY_MASK;
+
+    /// Handlers are the JavaScript callbacks to which `async_ctx` delivers
+    /// the events of the test.
+    SharedPtr<Handlers> handlers{new Handlers};
+
     /// Nettest is the test we want to execute.
     Nettest nettest;
 };
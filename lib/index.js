@@ -14,8 +14,76 @@ const LOG_DEBUG = 2
 const LOG_INFO = 1
 const LOG_WARNING = 0
 
+// The number of log lines kept by the log buffer when no bound is given.
+const defaultLogBufferLines = 1000
+
 const boolOption = option => option === true ? '1' : '0'
 
+const makeAbortError = () => {
+  const err = new Error('The test was cancelled')
+  err.name = 'AbortError'
+  err.code = 'ABORT_ERR'
+  return err
+}
+
+const makeMkOptions = options => {
+  /*
+   * Maps the options of a test to the corresponding MK options.
+   */
+  const mkOptions = {
+    'save_real_probe_ip': boolOption(options.includeIp || false),
+    'save_real_probe_asn': boolOption(options.includeAsn || true),
+    'save_real_probe_cc': boolOption(options.includeCountry || true),
+    'no_collector': boolOption(options.noCollector || false)
+  }
+  if (options.softwareName && options.softwareVersion) {
+    mkOptions['software_name'] = options.softwareName
+    mkOptions['software_version'] = options.softwareVersion
+  }
+
+  if (options.geoipCountryPath) {
+    mkOptions['geoip_country_path'] = options.geoipCountryPath
+  }
+  if (options.geoipAsnPath) {
+    mkOptions['geoip_asn_path'] = options.geoipAsnPath
+  }
+
+  if (options.outputPath) {
+    mkOptions['output_path'] = options.outputPath
+    mkOptions['no_file_report'] = '0'
+  } else {
+    mkOptions['no_file_report'] = '1'
+  }
+  mkOptions['net/ca_bundle_path'] = options.caBundlePath || caBundlePath
+  return mkOptions
+}
+
+const makeBatchPuller = (source, batchSize) => {
+  /*
+   * Returns a function returning the promise of the next batch of at most
+   * `batchSize` inputs from `source`, or of an empty batch when `source` is
+   * exhausted. `source` is either an (async) iterable or a function taking
+   * the batch size and returning (the promise of) an array of inputs.
+   */
+  if (typeof source === 'function') {
+    return () => Promise.resolve(source(batchSize)).then(batch => batch || [])
+  }
+  const iterator = (source[Symbol.asyncIterator] !== undefined)
+    ? source[Symbol.asyncIterator]()
+    : source[Symbol.iterator]()
+  return () => {
+    const batch = []
+    const step = () => Promise.resolve(iterator.next()).then(({ value, done }) => {
+      if (done) {
+        return batch
+      }
+      batch.push(value)
+      return (batch.length < batchSize) ? step() : batch
+    })
+    return step()
+  }
+}
+
 const makeNettestFactory = nettestName => options => {
   /*
    * Factory method to generate a new instance of the WebConnectivity class
@@ -41,35 +109,34 @@ const makeNettestFactory = nettestName => options => {
       this.addInput = this.addInput.bind(this)
       this.dataUsageUp = 0
       this.dataUsageDown = 0
+      this.inputsAdded = 0
     }
 
     setOptions(options) {
       this.options = options
 
-      this.test.set_options('save_real_probe_ip', boolOption(options.includeIp || false))
-      this.test.set_options('save_real_probe_asn', boolOption(options.includeAsn || true))
-      this.test.set_options('save_real_probe_cc', boolOption(options.includeCountry || true))
-      this.test.set_options('no_collector', boolOption(options.noCollector || false))
-      if (options.softwareName && options.softwareVersion) {
-        this.test.set_options('software_name', options.softwareName)
-        this.test.set_options('software_version', options.softwareVersion)
-      }
-
-      if (options.geoipCountryPath) {
-        this.test.set_options('geoip_country_path', options.geoipCountryPath)
+      // Note: we collect all MK options and set them with a single call
+      this.test.set_options_object(makeMkOptions(options))
+      if (options.entrySink) {
+        const { path, rotateBytes, rotateCount, fsync } = options.entrySink
+        this.test.set_entry_sink(path, rotateBytes || 0, rotateCount || 0,
+          fsync || 'none')
       }
-      if (options.geoipAsnPath) {
-        this.test.set_options('geoip_asn_path', options.geoipAsnPath)
+      if (options.logBuffer) {
+        const { lines, bytes } = options.logBuffer
+        // Note: the buffer must be bounded, hence we default to some lines
+        this.test.set_log_buffer(lines || (bytes ? 0 : defaultLogBufferLines),
+          bytes || 0)
       }
-
-      if (options.outputPath) {
-        this.test.set_options('output_path', options.outputPath)
-        this.test.set_options('no_file_report', '0')
-      } else {
-        this.test.set_options('no_file_report', '1')
+      const queueLimits = options.queueLimits || {}
+      Object.keys(queueLimits).forEach(klass => {
+        const { max, sampleEvery } = queueLimits[klass]
+        this.test.set_queue_limit(klass, max || 0, sampleEvery || 0)
+      })
+      if (options.coalesceProgress || options.progressIntervalMs) {
+        this.test.set_progress_interval(options.progressIntervalMs || 0)
       }
       this.test.set_verbosity(this.options.logLevel || LOG_INFO)
-      this.test.set_options('net/ca_bundle_path', options.caBundlePath || caBundlePath)
     }
 
     bindListeners() {
@@ -83,15 +150,37 @@ const makeNettestFactory = nettestName => options => {
         self.emit('overall-data-usage', {down, up})
       })
 
-      this.test.on_log((level, msg) => {
-        self.emit('log', level, msg)
-      })
-      this.test.on_entry((entry) => {
-        self.emit('entry', JSON.parse(entry))
-      })
+      // Lines more verbose than logMinLevel are dropped by the native side
+      const logOptions = {minLevel: this.options.logMinLevel}
+      if (this.options.logEvents === false) {
+        // Lines are only kept in the log buffer, if any (see getLogs)
+      } else if (this.options.batchLogs) {
+        this.test.on_log_batch((levels, msgs) => {
+          self.emit('log-batch', levels, msgs)
+        }, logOptions)
+      } else {
+        this.test.on_log((level, msg) => {
+          self.emit('log', level, msg)
+        }, logOptions)
+      }
+      if (this.options.entryBuffers) {
+        this.test.on_entry_buffer((buffer) => {
+          self.emit('entry-buffer', buffer)
+        })
+      } else {
+        this.test.on_entry_object((entry) => {
+          self.emit('entry', (typeof entry === 'string') ? JSON.parse(entry) : entry)
+        })
+      }
       this.test.on_event((e) => {
         self.emit('event', e)
       })
+      if (this.test.on_throughput && this.options.throughputIntervalMs) {
+        // Samples are [ms since start, bytes down, bytes up] triples
+        this.test.on_throughput((samples) => {
+          self.emit('throughput', samples)
+        }, this.options.throughputIntervalMs)
+      }
       this.test.on_end(() => {
         self.emit('end')
       })
@@ -102,18 +191,132 @@ const makeNettestFactory = nettestName => options => {
 
     addInput(input) {
       this.test.add_input(input);
+      this.inputsAdded += 1
     }
 
-    run() {
+    addInputs(inputs) {
+      const result = Buffer.isBuffer(inputs)
+        ? this.test.add_inputs_buffer(inputs)
+        : this.test.add_inputs(inputs)
+      this.inputsAdded += result.added
+      return result
+    }
+
+    droppedEvents() {
+      return this.test.dropped_events()
+    }
+
+    getLogs({ since, maxLines } = {}) {
+      return this.test.get_logs({since: since || 0, maxLines: maxLines || 0})
+    }
+
+    metrics() {
+      return this.test.metrics()
+    }
+
+    stats() {
+      return this.test.stats()
+    }
+
+    runStream(source, { batchSize, signal } = {}) {
+      /*
+       * Runs the test with inputs pulled from `source` (see makeBatchPuller)
+       * rather than added up front. Since MK needs all the inputs before a
+       * test starts, we run the test once per batch, and we pull the next
+       * batch while the current one runs, so that at most two batches are
+       * in memory and `source` is not consumed faster than we measure. The
+       * events of all runs, including one 'end' per batch, are emitted by
+       * this object. Inputs added before are measured with the first batch,
+       * and no test is run if there are none and `source` is empty. When
+       * stopped, no other batch is run.
+       *
+       * Each batch is a separate MK run, hence a separate report: with
+       * `outputPath`, the report of the batch `i > 0` is written into
+       * `outputPath.i`. Since metrics(), stats(), droppedEvents() and
+       * getLogs() only cover the batch being run, the returned promise
+       * resolves with an array containing, for each batch, its `metrics`,
+       * `stats` and `droppedEvents`.
+       */
+      const pull = makeBatchPuller(source, batchSize || 1000)
+      const results = []
+      const runBatch = (batch, index) => {
+        if (index > 0) {
+          this.test = new bindings[nettestName + 'Test']()
+          this.setOptions(this.options)
+          if (this.options.outputPath) {
+            // Note: otherwise MK would overwrite the previous reports
+            this.test.set_output_filepath(`${this.options.outputPath}.${index}`)
+          }
+          this.bindListeners()
+        }
+        this.addInputs(batch)
+        const next = pull()
+        // Note: `next` is only chained when run() succeeds, hence we handle
+        // its rejection now, lest it be unhandled when run() rejects too
+        next.catch(() => {})
+        return this.run({signal}).then(() => {
+          results.push({
+            metrics: this.metrics(),
+            stats: this.stats(),
+            droppedEvents: this.droppedEvents()
+          })
+          return next
+        })
+      }
+      const loop = (batch, index) => {
+        if (this.stopped) {
+          return Promise.reject(makeAbortError())
+        }
+        if (batch.length === 0 && (index > 0 || this.inputsAdded === 0)) {
+          return Promise.resolve(results)
+        }
+        return runBatch(batch, index).then(next => loop(next, index + 1))
+      }
+      return pull().then(batch => loop(batch, 0))
+    }
+
+    stop() {
+      /*
+       * MK cannot interrupt a running test, hence the test keeps running in
+       * the background until it is over, but no event is emitted anymore
+       * and the pending run() rejects with an AbortError.
+       */
+      this.stopped = true
+      this.test.stop()
+      if (this.cancelRun) {
+        this.cancelRun()
+      }
+    }
+
+    run({ signal } = {}) {
       const { test } = this
       return new Promise((resolve, reject) => {
-        test.start((err) => {
+        if (this.stopped || (signal && signal.aborted)) {
+          this.stopped = true
+          test.stop()
+          reject(makeAbortError())
+          return
+        }
+        const onAbort = () => this.stop()
+        const cancel = () => finish(makeAbortError())
+        const finish = (err) => {
+          if (this.cancelRun === cancel) {
+            this.cancelRun = null
+          }
+          if (signal) {
+            signal.removeEventListener('abort', onAbort)
+          }
           if (err) {
             reject(err)
             return
           }
           resolve()
-        })
+        }
+        this.cancelRun = cancel
+        if (signal) {
+          signal.addEventListener('abort', onAbort)
+        }
+        test.start(finish)
       })
     }
   }
@@ -122,6 +325,58 @@ const makeNettestFactory = nettestName => options => {
 
 }
 
+const setDrainBudget = ({ maxEvents, maxTimeMs, adaptive } = {}) => {
+  /*
+   * Limits how much work is done each time MK callbacks wake up the event
+   * loop, such that bursts of events do not starve other I/O. With adaptive
+   * set, the time budget shrinks when the event loop is busy.
+   */
+  bindings.set_drain_budget(maxEvents || 0, maxTimeMs || 0, adaptive || false)
+}
+
+const bridgeStats = () => bindings.bridge_stats()
+
+class NettestBatch extends EventEmitter {
+  /*
+   * Runs many tests, at most `concurrency` at a time, emitting their events
+   * along with the tag returned by add(), e.g. `('entry', tag, entry)`.
+   */
+  constructor({ concurrency, logLevel } = {}) {
+    super()
+    this.batch = new bindings.NettestBatch()
+    this.batch.set_concurrency(concurrency || 1)
+    this.batch.set_verbosity(logLevel || LOG_WARNING)
+  }
+
+  add(nettestName, options, inputs) {
+    /*
+     * Adds a test, e.g. `add('Ndt', {})`, and returns an object with its
+     * `tag` and, as addInputs(), the number of inputs `added` and of the
+     * `invalid` ones. Options are the same as for a single test, but only
+     * those mapped to MK options are used.
+     */
+    return this.batch.add(nettestName + 'Test', makeMkOptions(options || {}),
+      inputs || [])
+  }
+
+  run() {
+    /*
+     * Runs the tests and resolves with an array containing, for each test,
+     * its tag, name, number of entries, wall and CPU time and data usage.
+     */
+    const self = this
+    this.batch.on_begin(tag => self.emit('begin', tag))
+    this.batch.on_end(tag => self.emit('end', tag))
+    this.batch.on_entry((tag, entry) => self.emit('entry', tag, JSON.parse(entry)))
+    this.batch.on_event((tag, e) => self.emit('event', tag, e))
+    this.batch.on_log((tag, level, msg) => self.emit('log', tag, level, msg))
+    this.batch.on_progress((tag, percent, msg) => {
+      self.emit('progress', tag, percent, msg)
+    })
+    return new Promise(resolve => this.batch.start(resolve))
+  }
+}
+
 const WebConnectivity = makeNettestFactory('WebConnectivity')
 const TcpConnect = makeNettestFactory('TcpConnect')
 const Ndt = makeNettestFactory('Ndt')
@@ -148,6 +403,9 @@ const library = {
   FacebookMessenger,
   Telegram,
   Whatsapp,
+  NettestBatch,
+  setDrainBudget,
+  bridgeStats,
   LOG_DEBUG,
   LOG_INFO,
   LOG_WARNING,
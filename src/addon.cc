@@ -2,6 +2,7 @@
 // Measurement-kit is free software under the BSD license. See AUTHORS
 // and LICENSE for more information on the copying conditions.
 
+#include "private/node/nettest_batch.hpp"
 #include "private/node/nettest_wrap.hpp"
 
 // The version function returns MK version.
@@ -9,6 +10,47 @@ static NAN_METHOD(version) {
     info.GetReturnValue().Set(Nan::New(mk_version()).ToLocalChecked());
 }
 
+// The set_drain_budget function configures how much work the async bridge
+// does each time the loop of the calling thread wakes it up. The arguments
+// are the maximum number of callbacks, the maximum time in milliseconds (zero
+// means no limit for both) and whether to adapt the time budget to the event
+// loop lag.
+static NAN_METHOD(set_drain_budget) {
+    if (info.Length() != 3) {
+        Nan::ThrowError("invalid number of arguments");
+        return;
+    }
+    mk::node::async::DrainPolicy &policy =
+            mk::node::async::dispatcher<>(Nan::GetCurrentEventLoop())->policy;
+    policy.max_events = (uint64_t)info[0]->NumberValue();
+    policy.max_time_ns = (uint64_t)(info[1]->NumberValue() * 1e06);
+    policy.adaptive = info[2]->BooleanValue();
+    policy.slice_ns = policy.max_time_ns;
+}
+
+// The bridge_stats function returns the counters of the async bridge summed
+// over all the tests of the calling thread, both running and finished, in
+// the same format used by the stats() method of tests.
+static NAN_METHOD(bridge_stats) {
+    mk::node::async::Dispatcher &disp =
+            *mk::node::async::dispatcher<>(Nan::GetCurrentEventLoop());
+    mk::node::async::Stats total;
+    mk::node::async::accumulate(total, disp.retired);
+    for (auto &ctx : disp.channels) {
+        mk::node::async::accumulate(total, *ctx->stats);
+    }
+    // Note: a pass drains all the tests, so count passes only once
+    total.passes = disp.passes;
+    total.max_pass_events = disp.max_pass_events;
+    info.GetReturnValue().Set(mk::node::stats_object(total));
+}
+
+// The cleanup function closes the async bridge of the loop `arg` when the
+// environment running such loop is torn down (e.g. a worker thread exits).
+static void cleanup(void *arg) {
+    mk::node::async::close<>(static_cast<uv_loop_t *>(arg));
+}
+
 // The REGISTER_FUNC macro is a convenience macro to register a free
 // function into the exports dictionary.
 #define REGISTER_FUNC(name, func)                                              \
@@ -17,13 +59,17 @@ static NAN_METHOD(version) {
                     .ToLocalChecked());
 
 // The REGISTER_TEST macro is a convenience macro to register a test
-// class into the exports dictionary.
+// class into the exports dictionary, and its factory into the factories
+// used by NettestBatch.
 #define REGISTER_TEST(name)                                                    \
-    mk::node::NettestWrap<mk::nettests::name>::initialize(#name, target)
+    mk::node::NettestWrap<mk::nettests::name>::initialize(#name, target);      \
+    mk::node::register_factory<mk::nettests::name>(#name)
 
 // The initialize function fills in the exports for this module.
 NAN_MODULE_INIT(initialize) {
     REGISTER_FUNC("version", version);
+    REGISTER_FUNC("set_drain_budget", set_drain_budget);
+    REGISTER_FUNC("bridge_stats", bridge_stats);
     REGISTER_TEST(DashTest);
     REGISTER_TEST(DnsInjectionTest);
     REGISTER_TEST(HttpHeaderFieldManipulationTest);
@@ -36,8 +82,16 @@ NAN_MODULE_INIT(initialize) {
     REGISTER_TEST(WhatsappTest);
     REGISTER_TEST(TelegramTest);
     REGISTER_TEST(FacebookMessengerTest);
+    mk::node::NettestBatch::initialize(target);
+    // Note: we remove the hook first because Node aborts if the same hook
+    // is added twice, which happens if this module is initialized twice.
+    v8::Isolate *isolate = v8::Isolate::GetCurrent();
+    uv_loop_t *loop = Nan::GetCurrentEventLoop();
+    node::RemoveEnvironmentCleanupHook(isolate, cleanup, loop);
+    node::AddEnvironmentCleanupHook(isolate, cleanup, loop);
 }
 
-// The NODE_MODULE macro declares that this is a Node module with
-// initialization function called Initialize.
-NODE_MODULE(measurement_kit, initialize)
+// The NAN_MODULE_WORKER_ENABLED macro declares that this is a context-aware
+// Node module, which can also be loaded by worker threads, with
+// initialization function called initialize.
+NAN_MODULE_WORKER_ENABLED(measurement_kit, initialize)
@@ -0,0 +1,26 @@
+{
+  "targets": [
+    {
+      "target_name": "native_test",
+      "type": "executable",
+      "sources": [
+        "native_test.cc"
+      ],
+      "include_dirs": [
+        "../include"
+      ],
+      "libraries": [ "-luv" ],
+      "cflags_cc!": [ "-fno-rtti", "-fno-exceptions" ],
+      "cflags_cc": [ "-std=c++14" ],
+      "conditions": [
+        ['OS=="mac"', {
+          "xcode_settings": {
+            "OTHER_CPLUSPLUSFLAGS" : [ "-std=c++14" ],
+            "GCC_ENABLE_CPP_EXCEPTIONS": "YES",
+            "GCC_ENABLE_CPP_RTTI": "YES"
+          }
+        }]
+      ]
+    },
+  ]
+}